@@ -76,6 +76,18 @@ public:
 	}
 
 
+	/// Area of the six faces. The chance a random ray that hits a parent box also hits this one is proportional to it
+	double surface_area() const
+	{
+		double dx = x.size(), dy = y.size(), dz = z.size();
+		return 2.0 * (dx * dy + dy * dz + dz * dx);
+	}
+
+	point3 center() const
+	{
+		return {(x.min + x.max) * 0.5, (y.min + y.max) * 0.5, (z.min + z.max) * 0.5};
+	}
+
 	/// Returns the index (x,y,z) of the longest axis of the AABB
 	int longest_axis() const
 	{
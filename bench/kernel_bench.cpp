@@ -0,0 +1,315 @@
+﻿#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../json_writer.h"
+#include "../transformers.h"
+#include "../volume_convex.h"
+#include "../primitives/geometry/geo_cube.h"
+#include "../primitives/geometry/geo_disk.h"
+#include "../primitives/geometry/geo_quad.h"
+#include "../primitives/geometry/geo_sphere.h"
+#include "../primitives/materials/mat_diffuse.h"
+#include "../primitives/materials/mat_volumetric.h"
+
+// Micro-benchmarks for the intersection kernels. Every primitive is centered at the origin and fits in [-1, 1]^3,
+// and is fed the same pre-generated ray batches.
+
+using bench_clock = std::chrono::steady_clock;
+
+struct ray_batch
+{
+	std::string name;
+	std::vector<ray> rays;
+	bool misses = false; // every ray provably misses every primitive
+};
+
+/// Rays from a pinhole at (0, 0, 4) through a regular grid on the z = 0 plane, centered on (x, y)
+static std::vector<ray> coherent_rays(int count, double x, double y, double extent)
+{
+	std::vector<ray> rays;
+	rays.reserve(count);
+
+	int side = static_cast<int>(std::ceil(std::sqrt(count)));
+	point3 origin(0, 0, 4);
+	for (int i = 0; i < count; i++)
+	{
+		double u = (i % side + 0.5) / side;
+		double v = (i / side + 0.5) / side;
+		point3 target(x + (u - 0.5) * extent, y + (v - 0.5) * extent, 0);
+		rays.emplace_back(origin, target - origin);
+	}
+	return rays;
+}
+
+/// Uniformly distributed unit vector
+static vec3 random_direction(std::mt19937& rng)
+{
+	std::uniform_real_distribution<double> unit(-1.0, 1.0);
+	while (true)
+	{
+		vec3 p(unit(rng), unit(rng), unit(rng));
+		if (p.length_squared() > 1e-6 && p.length_squared() <= 1)
+			return unit_vector(p);
+	}
+}
+
+/// Rays from random points around the unit cube aimed at random points at `min_dist` to `max_dist` from the origin
+static std::vector<ray> incoherent_rays(int count, double min_dist, double max_dist, std::mt19937& rng)
+{
+	std::uniform_real_distribution<double> dist(min_dist, max_dist);
+	std::vector<ray> rays;
+	rays.reserve(count);
+	for (int i = 0; i < count; i++)
+	{
+		point3 origin = 4 * random_direction(rng);
+		point3 target = dist(rng) * random_direction(rng);
+		rays.emplace_back(origin, target - origin);
+	}
+	return rays;
+}
+
+/// Rays in random directions whose closest point to the origin is `min_dist` to `max_dist` away. With `min_dist`
+/// above sqrt(3) the whole line stays outside the ball around [-1, 1]^3, so they miss every primitive
+static std::vector<ray> incoherent_miss_rays(int count, double min_dist, double max_dist, std::mt19937& rng)
+{
+	std::uniform_real_distribution<double> dist(min_dist, max_dist);
+	std::vector<ray> rays;
+	rays.reserve(count);
+	while (static_cast<int>(rays.size()) < count)
+	{
+		point3 closest = dist(rng) * random_direction(rng);
+		vec3 direction = random_direction(rng);
+		direction = direction - dot(direction, closest) / closest.length_squared() * closest; // perpendicular to closest
+		if (direction.length_squared() < 1e-6)
+			continue;
+		direction = unit_vector(direction);
+		rays.emplace_back(closest - 4 * direction, direction);
+	}
+	return rays;
+}
+
+static std::vector<ray_batch> make_batches(int count)
+{
+	std::mt19937 rng(1234); // same batches every run
+	return {
+		{"coherent_hit", coherent_rays(count, 0, 0, 1.4)},
+		{"coherent_miss", coherent_rays(count, 3, 3, 1.4), true}, // passes the origin 2.9 away
+		{"incoherent_hit", incoherent_rays(count, 0, 0.7, rng)},
+		{"incoherent_miss", incoherent_miss_rays(count, 2, 3, rng), true},
+	};
+}
+
+struct kernel_result
+{
+	std::string kernel;
+	std::string batch;
+	double ns_per_ray;
+	double hit_ratio;
+	bool misses;
+};
+
+/// Runs `kernel` over the whole batch until `min_time` passes, keeps the fastest pass
+static kernel_result measure(const std::string& kernel_name, const ray_batch& batch, double min_time,
+                             const std::function<int(const std::vector<ray>&)>& kernel)
+{
+	double best = infinity;
+	int hits = 0;
+	double total = 0;
+	int passes = 0;
+	while (total < min_time || passes < 3)
+	{
+		auto start = bench_clock::now();
+		hits = kernel(batch.rays);
+		double t = std::chrono::duration<double>(bench_clock::now() - start).count();
+		best = std::min(best, t);
+		total += t;
+		passes++;
+	}
+
+	return {kernel_name, batch.name, best * 1e9 / batch.rays.size(), double(hits) / batch.rays.size(), batch.misses};
+}
+
+/// The whole batch through one virtual hittable::hit, like the BVH would call it
+static std::function<int(const std::vector<ray>&)> hit_kernel(const shared_ptr<hittable>& object)
+{
+	return [object](const std::vector<ray>& rays)
+	{
+		const hittable& target = *object;
+		hit_record rec;
+		int hits = 0;
+		for (const ray& r : rays)
+		{
+			if (target.hit(r, interval(0.001, infinity), rec))
+				hits++;
+		}
+		return hits;
+	};
+}
+
+static void print_usage()
+{
+	std::cout << "Usage: raytrack_kernel_bench [options]\n"
+		<< "  --rays <n>        Rays per batch (default: 16384)\n"
+		<< "  --min-time <ms>   Minimum time spent on each kernel/batch pair (default: 100)\n"
+		<< "  --output <file>   Write the JSON report here instead of stdout\n";
+}
+
+int main(int argc, char* argv[])
+{
+	int ray_count = 16384;
+	double min_time = 0.1;
+	std::string output;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+		{
+			print_usage();
+			return EXIT_SUCCESS;
+		}
+
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << '\n';
+			return EXIT_FAILURE;
+		}
+		std::string value = argv[++i];
+
+		try
+		{
+			if (arg == "--rays") ray_count = std::max(1, std::stoi(value));
+			else if (arg == "--min-time") min_time = std::stod(value) / 1000;
+			else if (arg == "--output") output = value;
+			else
+			{
+				std::cerr << "Unknown option: " << arg << '\n';
+				print_usage();
+				return EXIT_FAILURE;
+			}
+		}
+		catch (const std::exception&)
+		{
+			std::cerr << "Invalid value for " << arg << ": " << value << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
+	auto mat = make_shared<mat_diffuse>(color(.5, .5, .5));
+	auto mat_volume = make_shared<mat_volumetric>(color(.5, .5, .5));
+
+	auto box = aabb(point3(-1, -1, -1), point3(1, 1, 1));
+	auto sphere = make_shared<geo_sphere>(point3(0, 0, 0), 1, mat);
+	auto quad = make_shared<geo_quad>(point3(-1, -1, 0), vec3(2, 0, 0), vec3(0, 2, 0), mat);
+	auto disk = make_shared<geo_disk>(point3(-1, -1, 0), vec3(2, 0, 0), vec3(0, 2, 0), mat);
+	auto cube = make_shared<geo_cube>(point3(-1, -1, -1), point3(1, 1, 1), mat);
+	auto rotated = make_shared<trn_rotate>(cube, vec3(60, 15, 65)); // same angles as the Cornell preset
+	auto volume = make_shared<volume_convex>(sphere, 1.0, mat_volume);
+
+	std::vector<std::pair<std::string, std::function<int(const std::vector<ray>&)>>> kernels = {
+		{
+			"aabb::hit", [box](const std::vector<ray>& rays)
+			{
+				int hits = 0;
+				for (const ray& r : rays)
+				{
+					if (box.hit(r, interval(0.001, infinity)))
+						hits++;
+				}
+				return hits;
+			}
+		},
+		{"geo_sphere::hit", hit_kernel(sphere)},
+		{"geo_quad::hit", hit_kernel(quad)},
+		{"geo_cube::hit", hit_kernel(cube)},
+		{"trn_rotate::hit", hit_kernel(rotated)},
+		{"volume_convex::hit", hit_kernel(volume)},
+	};
+
+	std::vector<ray_batch> batches = make_batches(ray_count);
+
+	std::vector<kernel_result> results;
+	for (const auto& [name, kernel] : kernels)
+	{
+		for (const ray_batch& batch : batches)
+		{
+			results.push_back(measure(name, batch, min_time, kernel));
+			std::clog << name << ' ' << batch.name << ": " << results.back().ns_per_ray << " ns/ray\n";
+		}
+	}
+
+	// is_interior takes planar coordinates, so use where each ray crosses the disk's plane (z = 0)
+	for (const ray_batch& batch : batches)
+	{
+		std::vector<std::pair<double, double>> coords;
+		coords.reserve(batch.rays.size());
+		for (const ray& r : batch.rays)
+		{
+			double t = r.direction().z() != 0 ? -r.origin().z() / r.direction().z() : 0;
+			point3 p = r.at(t);
+			coords.emplace_back((p.x() + 1) / 2, (p.y() + 1) / 2);
+		}
+
+		results.push_back(measure("geo_disk::is_interior", batch, min_time,
+		                          [&disk, &coords](const std::vector<ray>&)
+		                          {
+			                          const geo_disk& target = *disk;
+			                          hit_record rec;
+			                          int hits = 0;
+			                          for (auto [a, b] : coords)
+			                          {
+				                          if (target.is_interior(a, b, rec))
+					                          hits++;
+			                          }
+			                          return hits;
+		                          }));
+		std::clog << "geo_disk::is_interior " << batch.name << ": " << results.back().ns_per_ray << " ns/ray\n";
+	}
+
+	// A miss batch that hits something would mix in the hit paths
+	for (const kernel_result& result : results)
+	{
+		if (result.misses && result.hit_ratio != 0)
+		{
+			std::cerr << result.kernel << ' ' << result.batch << ": " << result.hit_ratio * 100
+				<< "% of the rays hit, the batch is supposed to miss\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::ofstream file;
+	if (!output.empty())
+	{
+		file.open(output);
+		if (!file)
+		{
+			std::cerr << "Failed to open " << output << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
+	json_writer json(output.empty() ? std::cout : file);
+	json.begin_object();
+	json.field("benchmark", "raytrack_kernel_bench");
+	json.field("rays_per_batch", ray_count);
+	json.key("results");
+	json.begin_array();
+	for (const kernel_result& result : results)
+	{
+		json.begin_object();
+		json.field("kernel", result.kernel);
+		json.field("batch", result.batch);
+		json.field("ns_per_ray", result.ns_per_ray);
+		json.field("hit_ratio", result.hit_ratio);
+		json.end_object();
+	}
+	json.end_array();
+	json.end_object();
+
+	return EXIT_SUCCESS;
+}
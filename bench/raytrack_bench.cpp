@@ -0,0 +1,244 @@
+﻿#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../json_writer.h"
+#include "../render_stats.h"
+#include "../scene.h"
+#include "../scene_presets.h"
+#include "../viewport.h"
+
+// End-to-end throughput benchmark: renders every preset headless and reports JSON, so numbers can be compared across commits.
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+struct bench_run
+{
+	scene_preset preset;
+	int width, height;
+	int samples;
+	int threads;
+
+	double bvh_build_s = 0;  // scene::update
+	double accumulate_s = 0; // time spent inside viewport::update
+	double wall_s = 0;       // first worker started -> last sample merged
+	uint64_t rays = 0;
+};
+
+static void run(bench_run& b, int bounces, uint64_t seed)
+{
+	rand_seed(seed); // some presets are randomly generated, every run must get the same scene
+	scene scn = preset_scene_creator::create_scene(b.preset);
+	scn.s_camera.image_width = b.width;
+	scn.s_camera.image_height = b.height;
+
+	auto build_start = bench_clock::now();
+	scn.update(); // BVH
+	b.bvh_build_s = seconds_since(build_start);
+
+	viewport vp(std::move(scn), b.width, b.height, 0, true);
+	vp.set_max_bounces(bounces);
+	vp.set_seed(seed);
+	vp.set_sample_count(1);
+	vp.set_sample_limit(b.samples);
+	vp.update(); // apply settings
+
+	render_stats::reset();
+	auto start = bench_clock::now();
+	vp.set_worker_count(b.threads);
+
+	auto timed_update = [&vp, &b]
+	{
+		auto update_start = bench_clock::now();
+		vp.update();
+		b.accumulate_s += seconds_since(update_start);
+	};
+
+	while (vp.get_current_sample_count() < b.samples)
+	{
+		timed_update();
+		if (!vp.has_backlog())
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+
+	vp.set_worker_count(0, true);
+	while (vp.has_backlog())
+		timed_update();
+
+	b.wall_s = seconds_since(start);
+	b.rays = render_stats::collect().rays;
+}
+
+/// "1,2,8" -> {1, 2, 8}
+static std::vector<int> parse_int_list(const std::string& s)
+{
+	std::vector<int> values;
+	std::stringstream ss(s);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		values.push_back(std::stoi(item));
+	return values;
+}
+
+/// "320x240,640x480" -> {{320, 240}, {640, 480}}
+static std::vector<std::pair<int, int>> parse_resolution_list(const std::string& s)
+{
+	std::vector<std::pair<int, int>> values;
+	std::stringstream ss(s);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		auto x = item.find('x');
+		if (x == std::string::npos)
+			throw std::invalid_argument(item);
+		values.emplace_back(std::stoi(item.substr(0, x)), std::stoi(item.substr(x + 1)));
+	}
+	return values;
+}
+
+static void print_usage()
+{
+	std::cout << "Usage: raytrack_bench [options]\n"
+		<< "  --scenes <list>       Comma separated presets (default: all)\n"
+		<< "  --resolutions <list>  Comma separated WxH (default: 320x240)\n"
+		<< "  --samples <list>      Comma separated samples per pixel (default: 16)\n"
+		<< "  --threads <list>      Comma separated thread counts (default: 1,<all cores>)\n"
+		<< "  --bounces <n>         Max ray bounces (default: 20)\n"
+		<< "  --seed <n>            Random seed for the scenes and the render (default: 0)\n"
+		<< "  --output <file>       Write the JSON report here instead of stdout\n";
+}
+
+int main(int argc, char* argv[])
+{
+	int hardware_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+	std::vector<scene_preset> presets = {Empty, Sky, Cornell, Chrome, Spheres, Dark};
+	std::vector<std::pair<int, int>> resolutions = {{320, 240}};
+	std::vector<int> sample_counts = {16};
+	std::vector<int> thread_counts = {1};
+	if (hardware_threads > 1)
+		thread_counts.push_back(hardware_threads);
+	int bounces = 20;
+	uint64_t seed = 0;
+	std::string output;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+		{
+			print_usage();
+			return EXIT_SUCCESS;
+		}
+
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << '\n';
+			return EXIT_FAILURE;
+		}
+		std::string value = argv[++i];
+
+		try
+		{
+			if (arg == "--scenes")
+			{
+				presets.clear();
+				std::stringstream ss(value);
+				std::string name;
+				while (std::getline(ss, name, ','))
+				{
+					scene_preset preset;
+					if (!scene_preset_from_name(name, preset))
+					{
+						std::cerr << "Unknown scene: " << name << '\n';
+						return EXIT_FAILURE;
+					}
+					presets.push_back(preset);
+				}
+			}
+			else if (arg == "--resolutions") resolutions = parse_resolution_list(value);
+			else if (arg == "--samples") sample_counts = parse_int_list(value);
+			else if (arg == "--threads") thread_counts = parse_int_list(value);
+			else if (arg == "--bounces") bounces = std::stoi(value);
+			else if (arg == "--seed") seed = std::stoull(value);
+			else if (arg == "--output") output = value;
+			else
+			{
+				std::cerr << "Unknown option: " << arg << '\n';
+				print_usage();
+				return EXIT_FAILURE;
+			}
+		}
+		catch (const std::exception&)
+		{
+			std::cerr << "Invalid value for " << arg << ": " << value << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::vector<bench_run> runs;
+	for (scene_preset preset : presets)
+		for (auto [width, height] : resolutions)
+			for (int samples : sample_counts)
+				for (int threads : thread_counts)
+					runs.push_back({preset, width, height, std::max(1, samples), std::max(1, threads)});
+
+	for (bench_run& b : runs)
+	{
+		std::clog << "bench: " << scene_preset_get_name(b.preset) << ' ' << b.width << 'x' << b.height
+			<< ' ' << b.samples << "spp " << b.threads << " threads... ";
+		run(b, bounces, seed);
+		std::clog << b.wall_s << "s\n";
+	}
+
+	std::ofstream file;
+	if (!output.empty())
+	{
+		file.open(output);
+		if (!file)
+		{
+			std::cerr << "Failed to open " << output << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
+	json_writer json(output.empty() ? std::cout : file);
+	json.begin_object();
+	json.field("benchmark", "raytrack_bench");
+	json.field("hardware_threads", hardware_threads);
+	json.field("max_bounces", bounces);
+	json.field("seed", seed);
+	json.key("runs");
+	json.begin_array();
+	for (const bench_run& b : runs)
+	{
+		double pixel_samples = static_cast<double>(b.width) * b.height * b.samples;
+
+		json.begin_object();
+		json.field("scene", scene_preset_get_name(b.preset));
+		json.field("width", b.width);
+		json.field("height", b.height);
+		json.field("samples", b.samples);
+		json.field("threads", b.threads);
+		json.field("bvh_build_ms", b.bvh_build_s * 1000);
+		json.field("accumulate_ms", b.accumulate_s * 1000);
+		json.field("wall_ms", b.wall_s * 1000);
+		json.field("rays", b.rays);
+		json.field("mrays_per_s", b.rays / b.wall_s / 1e6);
+		json.field("samples_per_s", pixel_samples / b.wall_s);
+		json.end_object();
+	}
+	json.end_array();
+	json.end_object();
+
+	return EXIT_SUCCESS;
+}
@@ -6,81 +6,339 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "huge_page_allocator.h"
+#include "render_stats.h"
+#include "task_pool.h"
 
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
 
-class bvh_node : public hittable
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// How the BVH is split into nodes
+enum bvh_build
 {
-public:
-	hittable_type get_type() const override { return hittable_type::bvh; }
+	Bvh_median, // median object along the longest axis
+	Bvh_sah,    // surface area heuristic over binned centroids
+};
+
+[[nodiscard]] inline std::string bvh_build_get_human_name(bvh_build build)
+{
+	switch (build)
+	{
+	case Bvh_median:
+		return "Median split";
+	case Bvh_sah:
+		return "Surface area heuristic";
+	default:
+		return "Unknown";
+	}
+}
+
+/// One node of the flattened binary BVH the builders produce, 32 bytes so two share a cache line.
+/// Bounds are floats rounded outwards, a ray can't slip between a box and its double precision contents.
+/// An interior node's first child follows it, `offset` is the second one. A leaf's objects are
+/// primitives[offset, offset + count)
+struct bvh_linear_node
+{
+	float min[3];
+	float max[3];
+	uint32_t offset;
+	uint16_t count; // 0: interior
+	uint8_t axis;   // interior: split axis, the child on the side the ray comes from goes first
+	uint8_t pad;
+};
+static_assert(sizeof(bvh_linear_node) == 32, "bvh_linear_node must stay 32 bytes");
 
-	bvh_node(){skip = true;} // WARN! ONLY FOR PLACEHOLDER FOR SCENE
+/// Children per node of the traversed BVH: one per SIMD lane, 8 with AVX and 4 otherwise
+#if defined(__AVX__)
+constexpr int bvh_width = 8;
+#else
+constexpr int bvh_width = 4;
+#endif
 
-	// list is referenced :)
-	bvh_node(hittable_list& list) : bvh_node(list.objects, 0, list.objects.size()) { }
+/// A node of the wide BVH the rays walk through: the boxes of all its children, structure of arrays so one vector
+/// instruction handles a bound for every child. 128 bytes (BVH4) or 256 bytes (BVH8), whole cache lines.
+/// Unused children have an inside out box that no ray hits
+struct bvh_wide_node
+{
+	float bounds[6][bvh_width]; // min x, y, z, max x, y, z
+	int32_t child[bvh_width];   // interior: node index. Leaf: first primitive
+	uint16_t count[bvh_width];  // leaf: number of primitives. 0: interior (or unused)
+	uint8_t pad[(64 - (6 * 4 + 4 + 2) * bvh_width % 64) % 64];
+};
+static_assert(sizeof(bvh_wide_node) % 64 == 0, "bvh_wide_node must fill whole cache lines");
+
+/// A list placed in the scene by move and rotate transforms, as its own BVH (bottom level) and one transform. All
+/// instances of the list share that BVH, so a copy costs a transform and a pointer however big the list is
+class bvh_instance : public hittable
+{
+public:
+	hittable_type get_type() const override { return hittable_type::instance; }
 
-	// binary search
-	bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end)
+	/// `source`: the outermost transform. `blas`: BVH of `geometry`, may be built after this
+	bvh_instance(shared_ptr<hittable> source, const rigid_transform& transform, const hittable* geometry,
+	             shared_ptr<const hittable> blas)
+		: source(std::move(source)), transform(transform), geometry(geometry), blas(std::move(blas))
 	{
-		if (start == 0 && end == 0)
-		{
-			skip = true;
-			return;
-		}
+		name = this->source->name;
+		bbox = transform.apply(geometry->bounding_box());
+	}
 
-		// Build total AABB first
-		bbox = aabb::empty;
-		for (size_t object_index = start; object_index < end; object_index++)
+	/// Follows the transforms from `object` down to what they place
+	///
+	/// Returns: True if `object` is a transform and places a non-empty list, the geometry worth a BVH of its own
+	static bool resolve(const shared_ptr<hittable>& object, rigid_transform& transform, shared_ptr<hittable>& geometry)
+	{
+		transform = rigid_transform();
+		geometry = object;
+		rigid_transform step;
+		shared_ptr<hittable> inner;
+		while (geometry->get_placement(step, inner))
 		{
-			bbox = aabb(bbox, objects[object_index]->bounding_box());
+			transform = transform * step;
+			geometry = inner;
 		}
+		return geometry != object && geometry->get_type() == hittable_type::list &&
+		       !static_cast<const hittable_list&>(*geometry).objects.empty();
+	}
 
-		int axis = bbox.longest_axis();
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	{
+		// ray: world space --> object space. Rotations keep lengths, so t means the same in both
+		ray local(transform.inverse(r.origin()), transform.inverse_direction(r.direction()), r.time());
+		if (!blas->hit(local, ray_t, rec))
+			return false;
 
-		auto comparator = (axis == 0) ? box_x_compare
-								 : (axis == 1) ? box_y_compare
-											   : box_z_compare;
+		// intersection: object space --> world space
+		rec.p = transform.apply(rec.p);
+		rec.normal = transform.apply_direction(rec.normal);
+		return true;
+	}
 
-		size_t object_span = end - start;
+	aabb bounding_box() const override { return bbox; }
 
+	/// After the transforms were edited, takes their new placement
+	///
+	/// Returns: False if they place other geometry now, which needs a new BVH
+	bool refresh()
+	{
+		rigid_transform placed;
+		shared_ptr<hittable> target;
+		if (!resolve(source, placed, target) || target.get() != geometry)
+			return false;
 
-		switch (object_span) {
-		case 1:
-			left = right = objects[start];
-			break;
-		case 2:
-			left = objects[start];
-			right = objects[start+1];
-			break;
-		default:
-			std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+		transform = placed;
+		bbox = transform.apply(geometry->bounding_box());
+		return true;
+	}
 
-			auto mid = start + object_span/2;
-			left = std::make_shared<bvh_node>(objects, start, mid);
-			right = std::make_shared<bvh_node>(objects, mid, end);
-			break;
+	/// Every transform from the source down, editing any of them moves this instance
+	void get_transforms(std::vector<const hittable*>& out) const
+	{
+		rigid_transform step;
+		shared_ptr<hittable> inner;
+		for (shared_ptr<hittable> object = source; object->get_placement(step, inner); object = inner)
+			out.push_back(object.get());
+	}
+
+private:
+	shared_ptr<hittable> source;
+	rigid_transform transform; // object space --> world space
+	const hittable* geometry;  // the list, kept alive by source
+	shared_ptr<const hittable> blas;
+	aabb bbox;
+};
+
+class bvh_node : public hittable
+{
+public:
+	hittable_type get_type() const override { return hittable_type::bvh; }
+
+	bvh_node() = default; // empty, hits nothing. Placeholder for the scene
+
+	// median split, for compatibility
+	bvh_node(hittable_list& list) : bvh_node(build(list, Bvh_median)) { }
+
+	/// An object with its box and centroid, computed once for the whole build
+	struct build_item
+	{
+		aabb bbox;
+		point3 centroid;
+		shared_ptr<hittable> object;
+	};
+
+	/// The bottom level BVH of a list that is placed by transforms. `tree` is shared by the list's instances and
+	/// filled in by the build
+	struct blas_input
+	{
+		std::vector<build_item> items;
+		shared_ptr<bvh_node> tree;
+	};
 
+	/// What a build needs from a list. Taken up front, the build can run on other threads while the list is edited
+	struct build_input
+	{
+		std::vector<build_item> items;   // the top level, bvh_instance for transformed lists
+		std::vector<blas_input> blases;  // one per distinct transformed list, SAH only
+		bvh_build method = Bvh_sah;
+	};
+
+	/// Doesn't change `list`
+	static build_input prepare(const hittable_list& list, bvh_build method)
+	{
+		build_input input;
+		input.method = method;
+		input.items.reserve(list.objects.size());
+		std::unordered_map<const hittable*, shared_ptr<bvh_node>> blas_of;
+		add_build_items(list, input, input.items, blas_of);
+		return input;
+	}
+
+	/// Doesn't change `list`
+	static bvh_node build(hittable_list& list, bvh_build method)
+	{
+		return build(prepare(list, method));
+	}
+
+	/// `pool`: The bottom level BVHs and the top levels of every BVH are built as tasks on it, the calling thread
+	/// helps until all are done
+	static bvh_node build(build_input input, task_pool* pool = nullptr)
+	{
+		// The instances only point at their BVH, so the top level needn't wait for the bottom
+		if (pool)
+		{
+			task_group group(*pool);
+			for (blas_input& bottom : input.blases)
+			{
+				group.run([&bottom, method = input.method, pool]()
+				{
+					*bottom.tree = build_tree(bottom.items, method, pool);
+				});
+			}
+			bvh_node tree = build_tree(input.items, input.method, pool);
+			group.wait();
+			return tree;
 		}
 
-		skip = false;
+		for (blas_input& bottom : input.blases)
+			*bottom.tree = build_tree(bottom.items, input.method, nullptr);
+		return build_tree(input.items, input.method, nullptr);
 	}
 
 	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
 	{
-		if (skip)
+		if (nodes.empty())
 			return false;
 
-		if (!bbox.hit(r, ray_t))
-			return false;
+		ray_stats& stats = render_stats::local();
+		ray_lanes lanes(r);
 
-		bool hit_left = left->hit(r, ray_t, rec);
-		bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+		// Children still to visit, nearest on top. The build keeps the depth below max_depth and every level leaves
+		// at most bvh_width - 1 children behind, so this can't overflow
+		stack_entry stack[max_depth * (bvh_width - 1) + 1];
+		int stack_size = 0;
+		stack[stack_size++] = {0, 0, static_cast<float>(ray_t.min)};
+		bool hit_any = false;
+		while (stack_size > 0)
+		{
+			stack_entry entry = stack[--stack_size];
+			if (entry.t_near > ray_t.max)
+				continue; // something closer was hit since it was pushed
 
-		return hit_left || hit_right;
+			if (entry.count > 0)
+			{
+				auto first = static_cast<uint32_t>(entry.child);
+				for (uint32_t i = first; i < first + entry.count; i++)
+				{
+					if (primitives[i]->hit(r, ray_t, rec))
+					{
+						hit_any = true;
+						ray_t.max = rec.t;
+					}
+				}
+				continue;
+			}
+
+			const bvh_wide_node& node = nodes[entry.child];
+			stat_add(stats.bvh_nodes);
+			float t_near[bvh_width];
+			unsigned mask = children_hit(node, lanes, static_cast<float>(ray_t.min), static_cast<float>(ray_t.max),
+			                             t_near);
+
+			// Front to back: the children that were hit go on the stack farthest first
+			int first = stack_size;
+			for (; mask != 0; mask &= mask - 1)
+			{
+				int lane = std::countr_zero(mask);
+				stack_entry child{node.child[lane], node.count[lane], t_near[lane]};
+				int i = stack_size++;
+				for (; i > first && stack[i - 1].t_near < child.t_near; i--)
+					stack[i] = stack[i - 1];
+				stack[i] = child;
+			}
+		}
+
+		return hit_any;
 	}
 
 	aabb bounding_box() const override { return bbox; }
 
+	/// Instead of a rebuild, after objects moved or changed size, or an instance's transforms were edited: their leaves'
+	/// boxes are recomputed and so are the boxes of every node above them. The tree keeps its structure.
+	///
+	/// Returns: False if an object isn't a primitive of this tree (say, it's inside a list or transform), or the boxes
+	/// grew so much that rays would be slower than after a rebuild. The tree needs a rebuild then
+	bool refit(const std::vector<const hittable*>& changed)
+	{
+		if (nodes.empty())
+			return changed.empty();
+
+		if (primitive_lookup.empty())
+			prepare_refit();
+
+		for (const hittable* object : changed)
+		{
+			auto found = std::lower_bound(primitive_lookup.begin(), primitive_lookup.end(),
+			                              std::make_pair(object, uint32_t{0}));
+			if (found == primitive_lookup.end() || found->first != object)
+				return false;
+
+			// The same object may be in the tree more than once
+			for (; found != primitive_lookup.end() && found->first == object; ++found)
+			{
+				shared_ptr<hittable>& primitive = objects[found->second];
+				if (primitive->get_type() == hittable_type::instance &&
+				    !static_cast<bvh_instance&>(*primitive).refresh())
+					return false;
+
+				uint32_t slot = primitive_slot[found->second];
+				const bvh_wide_node& leaf_node = nodes[slot / bvh_width];
+				int lane = static_cast<int>(slot % bvh_width);
+				aabb box = aabb::empty;
+				for (int32_t i = leaf_node.child[lane]; i < leaf_node.child[lane] + leaf_node.count[lane]; i++)
+					box = aabb(box, primitives[i]->bounding_box());
+				set_lane_box(slot, box);
+
+				// Every ancestor is the union of its children
+				for (uint32_t node = slot / bvh_width; node_parent[node] != no_parent; node = node_parent[node] / bvh_width)
+					set_lane_box(node_parent[node], lanes_box(nodes[node]));
+			}
+		}
+		bbox = lanes_box(nodes[0]);
+
+		return refit_cost() <= built_cost * refit_cost_limit;
+	}
+
 
 	bool inspector_ui(viewport& _viewport, scene& _scene) override
 	{
@@ -89,25 +347,710 @@ public:
 	}
 
 private:
-	bool skip = false;
-	shared_ptr<hittable> left;
-	shared_ptr<hittable> right;
+	huge_vector<bvh_wide_node> nodes;       // depth first, the root is nodes[0]
+	std::vector<const hittable*> primitives; // in leaf order
+	std::vector<shared_ptr<hittable>> objects; // keeps primitives alive
 	aabb bbox;
 
-	static bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index)
+	/// For refit(), set up by the first one. A slot is node index * bvh_width + lane
+	static constexpr uint32_t no_parent = UINT32_MAX;
+	std::vector<std::pair<const hittable*, uint32_t>> primitive_lookup; // (object, primitive index), sorted
+	std::vector<uint32_t> primitive_slot; // per primitive, the leaf lane it's in
+	std::vector<uint32_t> node_parent;    // per node, the lane pointing to it. no_parent for the root
+	double lane_area = 0;                 // surface area of all used lanes, kept up to date by set_lane_box()
+	double built_cost = 0;                // refit_cost() as built
+
+	/// Once a refit made the tree this much more expensive than it was built, a rebuild is better
+	static constexpr double refit_cost_limit = 1.5;
+
+	/// A ray in the form the box tests want: single precision, inverse direction, and which bound of every axis it
+	/// enters through
+	struct ray_lanes
+	{
+		float origin[3];
+		float inv_dir[3];
+		int near[3]; // row in bvh_wide_node::bounds
+		int far[3];
+
+		explicit ray_lanes(const ray& r)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				origin[a] = static_cast<float>(r.origin()[a]);
+				inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+				near[a] = inv_dir[a] < 0 ? a + 3 : a;
+				far[a] = inv_dir[a] < 0 ? a : a + 3;
+			}
+		}
+	};
+
+	struct stack_entry
+	{
+		int32_t child;
+		uint32_t count;
+		float t_near;
+	};
+
+	/// Float rounding in the slab test can only make boxes look a little shorter, the exit distance is pushed out by
+	/// more than that
+	static constexpr float far_scale = 1.0f + 4 * std::numeric_limits<float>::epsilon();
+
+	/// Traversal stack size. Below it the build switches to median splits, which halve what's left at every level
+	static constexpr int max_depth = 64;
+	static constexpr int median_depth = max_depth - 32;
+
+	/// SAH cost model, relative to one box test. Leaves hold up to max_leaf_size objects when that's cheaper than
+	/// splitting further
+	static constexpr int sah_bins = 16;
+	static constexpr double traversal_cost = 1.0;
+	static constexpr double intersect_cost = 1.0;
+	static constexpr size_t max_leaf_size = 4;
+
+	/// Ranges of at least this many items are built by parallel tasks, in chunks of chunk_items
+	static constexpr size_t parallel_min_items = 16384;
+	static constexpr size_t chunk_items = 8192;
+
+	/// Nested lists are opened up for the SAH build, a list only returns the closest hit of its objects, which the
+	/// tree does as well. Transformed lists become instances of a bottom level BVH instead, one per list in `blas_of`
+	static void add_build_items(const hittable_list& list, build_input& input, std::vector<build_item>& items,
+	                            std::unordered_map<const hittable*, shared_ptr<bvh_node>>& blas_of)
+	{
+		bool sah = input.method == Bvh_sah;
+		for (const shared_ptr<hittable>& object : list.objects)
+		{
+			if (sah && object->get_type() == hittable_type::list)
+			{
+				add_build_items(static_cast<const hittable_list&>(*object), input, items, blas_of);
+				continue;
+			}
+
+			rigid_transform transform;
+			shared_ptr<hittable> geometry;
+			if (sah && bvh_instance::resolve(object, transform, geometry))
+			{
+				shared_ptr<bvh_node>& blas = blas_of[geometry.get()];
+				if (!blas)
+				{
+					blas = make_shared<bvh_node>();
+					blas_input bottom{{}, blas};
+					add_build_items(static_cast<const hittable_list&>(*geometry), input, bottom.items, blas_of);
+					input.blases.push_back(std::move(bottom));
+				}
+
+				auto instance = make_shared<bvh_instance>(object, transform, geometry.get(), blas);
+				aabb box = instance->bounding_box();
+				items.push_back({box, box.center(), instance});
+				continue;
+			}
+
+			aabb box = object->bounding_box();
+			items.push_back({box, box.center(), object});
+		}
+	}
+
+	/// One BVH over `items`, reordering them into leaf order
+	static bvh_node build_tree(std::vector<build_item>& items, bvh_build method, task_pool* pool)
 	{
-		auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-		auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-		return a_axis_interval.min < b_axis_interval.min;
+		bvh_node tree;
+		if (items.empty())
+			return tree;
+
+		// A subtree of n items has at most 2n - 1 nodes, parallel tasks write theirs at fixed places with gaps between
+		std::vector<bvh_linear_node> binary(2 * items.size() - 1);
+		if (pool && items.size() >= parallel_min_items)
+		{
+			build_parallel(binary.data(), 0, items, 0, items.size(), method, 0, *pool);
+		}
+		else
+		{
+			uint32_t next = 0;
+			build_recursive(binary.data(), next, items, 0, items.size(), method, 0);
+		}
+		tree.nodes.reserve(binary.size() / (bvh_width - 1) + 1);
+		tree.collapse(binary, 0);
+
+		tree.objects.reserve(items.size());
+		tree.primitives.reserve(items.size());
+		for (const build_item& item : items)
+		{
+			tree.primitives.push_back(item.object.get());
+			tree.objects.push_back(item.object);
+		}
+		tree.bbox = node_box(binary[0]);
+		return tree;
 	}
 
+	/// Writes the subtree of items [start, end) to binary[next...] in depth first order, reordering the items into leaf
+	/// order
+	///
+	/// Returns: Index of the subtree's root node
+	static uint32_t build_recursive(bvh_linear_node* binary, uint32_t& next, std::vector<build_item>& items,
+	                                size_t start, size_t end, bvh_build method, int depth)
+	{
+		aabb box = aabb::empty;
+		for (size_t i = start; i < end; i++)
+			box = aabb(box, items[i].bbox);
+
+		uint32_t index = next++;
+		binary[index] = make_node(box);
 
-	static bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) { return box_compare(a, b, 0); }
-	static bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) { return box_compare(a, b, 1); }
-	static bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) { return box_compare(a, b, 2); }
+		size_t mid;
+		int axis;
+		bool split = method == Bvh_sah && depth < median_depth
+			             ? split_sah(items, start, end, box, mid, axis, nullptr)
+			             : split_median(items, start, end, box, mid, axis);
+		if (!split)
+		{
+			binary[index].offset = static_cast<uint32_t>(start);
+			binary[index].count = static_cast<uint16_t>(end - start);
+			return index;
+		}
+
+		build_recursive(binary, next, items, start, mid, method, depth + 1);
+		uint32_t second = build_recursive(binary, next, items, mid, end, method, depth + 1);
+		binary[index].offset = second;
+		binary[index].axis = static_cast<uint8_t>(axis);
+		return index;
+	}
 
+	/// build_recursive() with the two halves of big ranges as parallel tasks, and their binning and partitioning split
+	/// into chunks. The subtree goes to binary[index], the first child's subtree right after it and the second one's
+	/// 2 * (first child's items) - 1 nodes later
+	static void build_parallel(bvh_linear_node* binary, uint32_t index, std::vector<build_item>& items, size_t start,
+	                           size_t end, bvh_build method, int depth, task_pool& pool)
+	{
+		if (end - start < parallel_min_items)
+		{
+			uint32_t next = index;
+			build_recursive(binary, next, items, start, end, method, depth);
+			return;
+		}
+
+		std::vector<aabb> chunk_boxes(chunk_count(&pool, end - start));
+		for_each_chunk(&pool, start, end, [&](size_t chunk, size_t begin, size_t stop)
+		{
+			aabb box = aabb::empty;
+			for (size_t i = begin; i < stop; i++)
+				box = aabb(box, items[i].bbox);
+			chunk_boxes[chunk] = box;
+		});
+		aabb box = aabb::empty;
+		for (const aabb& chunk_box : chunk_boxes)
+			box = aabb(box, chunk_box);
+		binary[index] = make_node(box);
+
+		size_t mid;
+		int axis;
+		bool split = method == Bvh_sah && depth < median_depth
+			             ? split_sah(items, start, end, box, mid, axis, &pool)
+			             : split_median(items, start, end, box, mid, axis);
+		if (!split)
+		{
+			binary[index].offset = static_cast<uint32_t>(start);
+			binary[index].count = static_cast<uint16_t>(end - start);
+			return;
+		}
+
+		auto second = static_cast<uint32_t>(index + 2 * (mid - start));
+		binary[index].offset = second;
+		binary[index].axis = static_cast<uint8_t>(axis);
+
+		task_group group(pool);
+		group.run([&] { build_parallel(binary, index + 1, items, start, mid, method, depth + 1, pool); });
+		build_parallel(binary, second, items, mid, end, method, depth + 1, pool);
+		group.wait();
+	}
+
+	/// Chunks for_each_chunk() splits `count` items into
+	static size_t chunk_count(const task_pool* pool, size_t count)
+	{
+		return pool ? (count + chunk_items - 1) / chunk_items : 1;
+	}
+
+	/// Calls fn(chunk, begin, end) for every chunk of [start, end), as tasks on `pool` (if there is one)
+	template <typename Fn>
+	static void for_each_chunk(task_pool* pool, size_t start, size_t end, const Fn& fn)
+	{
+		size_t chunks = chunk_count(pool, end - start);
+		if (chunks <= 1)
+		{
+			fn(0, start, end);
+			return;
+		}
+
+		task_group group(*pool);
+		for (size_t chunk = 1; chunk < chunks; chunk++)
+		{
+			group.run([&fn, chunk, start, end]
+			{
+				fn(chunk, start + chunk * chunk_items, std::min(start + (chunk + 1) * chunk_items, end));
+			});
+		}
+		fn(0, start, start + chunk_items);
+		group.wait();
+	}
+
+	/// std::partition, in chunks on `pool` (if there is one). Items keep their order within each side
+	///
+	/// Returns: Index of the first item `pred` is false for
+	template <typename Pred>
+	static size_t partition_items(std::vector<build_item>& items, size_t start, size_t end, const Pred& pred,
+	                              task_pool* pool)
+	{
+		size_t chunks = chunk_count(pool, end - start);
+		if (chunks <= 1)
+			return std::partition(items.begin() + start, items.begin() + end, pred) - items.begin();
+
+		// Count each chunk's left side, then every chunk knows where its items go
+		std::vector<size_t> left_counts(chunks);
+		for_each_chunk(pool, start, end, [&](size_t chunk, size_t begin, size_t stop)
+		{
+			size_t n = 0;
+			for (size_t i = begin; i < stop; i++)
+				n += pred(items[i]) ? 1 : 0;
+			left_counts[chunk] = n;
+		});
+
+		std::vector<size_t> left_at(chunks);
+		size_t left_total = 0;
+		for (size_t chunk = 0; chunk < chunks; chunk++)
+		{
+			left_at[chunk] = left_total;
+			left_total += left_counts[chunk];
+		}
+
+		std::vector<build_item> sorted(end - start);
+		for_each_chunk(pool, start, end, [&](size_t chunk, size_t begin, size_t stop)
+		{
+			size_t left = left_at[chunk];
+			size_t right = left_total + (begin - start) - left_at[chunk];
+			for (size_t i = begin; i < stop; i++)
+				sorted[pred(items[i]) ? left++ : right++] = std::move(items[i]);
+		});
+		for_each_chunk(pool, start, end, [&](size_t /*chunk*/, size_t begin, size_t stop)
+		{
+			std::move(sorted.begin() + (begin - start), sorted.begin() + (stop - start), items.begin() + begin);
+		});
+		return start + left_total;
+	}
+
+	/// Turns the binary subtree at binary[index] into wide nodes: the children are opened up, largest surface area
+	/// first, until there are bvh_width of them or only leaves are left. The depth never grows
+	///
+	/// Returns: Index of the wide node
+	int32_t collapse(const std::vector<bvh_linear_node>& binary, uint32_t index)
+	{
+		std::array<uint32_t, bvh_width> children{};
+		int child_count = 0;
+		if (binary[index].count > 0)
+		{
+			children[child_count++] = index; // a lone leaf, the whole tree
+		}
+		else
+		{
+			children[child_count++] = index + 1;
+			children[child_count++] = binary[index].offset;
+		}
+
+		while (child_count < bvh_width)
+		{
+			int largest = -1;
+			double largest_area = -1;
+			for (int i = 0; i < child_count; i++)
+			{
+				const bvh_linear_node& child = binary[children[i]];
+				double area = child.count > 0 ? -1 : node_box(child).surface_area();
+				if (area > largest_area)
+				{
+					largest = i;
+					largest_area = area;
+				}
+			}
+			if (largest < 0 || binary[children[largest]].count > 0)
+				break;
+
+			uint32_t opened = children[largest];
+			children[largest] = opened + 1;
+			children[child_count++] = binary[opened].offset;
+		}
+
+		auto wide = static_cast<int32_t>(nodes.size());
+		nodes.emplace_back();
+		for (int lane = 0; lane < bvh_width; lane++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				nodes[wide].bounds[a][lane] = std::numeric_limits<float>::infinity();
+				nodes[wide].bounds[a + 3][lane] = -std::numeric_limits<float>::infinity();
+			}
+			nodes[wide].child[lane] = -1;
+			nodes[wide].count[lane] = 0;
+		}
+
+		for (int lane = 0; lane < child_count; lane++)
+		{
+			const bvh_linear_node& child = binary[children[lane]];
+			for (int a = 0; a < 3; a++)
+			{
+				nodes[wide].bounds[a][lane] = child.min[a];
+				nodes[wide].bounds[a + 3][lane] = child.max[a];
+			}
+
+			if (child.count > 0)
+			{
+				nodes[wide].child[lane] = static_cast<int32_t>(child.offset);
+				nodes[wide].count[lane] = child.count;
+			}
+			else
+			{
+				int32_t subtree = collapse(binary, children[lane]); // may move nodes, index again after
+				nodes[wide].child[lane] = subtree;
+			}
+		}
+		return wide;
+	}
+
+	/// The original split: sorted by box along the longest axis, halved. Up to two objects make a leaf
+	///
+	/// Returns: False for a leaf
+	static bool split_median(std::vector<build_item>& items, size_t start, size_t end, const aabb& box, size_t& mid,
+	                         int& axis)
+	{
+		size_t count = end - start;
+		if (count <= 2)
+			return false;
+
+		axis = box.longest_axis();
+		mid = start + count / 2;
+		std::nth_element(items.begin() + start, items.begin() + mid, items.begin() + end,
+		                 [axis](const build_item& a, const build_item& b)
+		                 {
+			                 return a.bbox.axis_interval(axis).min < b.bbox.axis_interval(axis).min;
+		                 });
+		return true;
+	}
+
+	/// Boxes and object counts of the bins on all three axes
+	struct sah_bin_set
+	{
+		std::array<aabb, sah_bins> boxes[3];
+		std::array<size_t, sah_bins> counts[3]{};
+	};
+
+	/// Bins the centroids on all three axes, prices every bin plane and partitions in place, no sorting.
+	/// `pool`: Binning and partitioning run in chunks on it
+	///
+	/// Returns: False for a leaf
+	static bool split_sah(std::vector<build_item>& items, size_t start, size_t end, const aabb& box, size_t& mid,
+	                      int& axis, task_pool* pool)
+	{
+		size_t count = end - start;
+		if (count == 1)
+			return false;
+
+		// Per chunk, merged after
+		size_t chunks = chunk_count(pool, count);
+		std::vector<std::array<interval, 3>> chunk_bounds(chunks);
+		for_each_chunk(pool, start, end, [&](size_t chunk, size_t begin, size_t stop)
+		{
+			std::array<interval, 3>& bounds = chunk_bounds[chunk];
+			for (size_t i = begin; i < stop; i++)
+			{
+				for (int a = 0; a < 3; a++)
+				{
+					double c = items[i].centroid[a];
+					bounds[a] = interval(std::min(bounds[a].min, c), std::max(bounds[a].max, c));
+				}
+			}
+		});
+		interval centroid_bounds[3];
+		for (const std::array<interval, 3>& bounds : chunk_bounds)
+		{
+			for (int a = 0; a < 3; a++)
+				centroid_bounds[a] = interval(centroid_bounds[a], bounds[a]);
+		}
+
+		std::vector<sah_bin_set> chunk_bins(chunks);
+		for_each_chunk(pool, start, end, [&](size_t chunk, size_t begin, size_t stop)
+		{
+			sah_bin_set& bins = chunk_bins[chunk];
+			for (int a = 0; a < 3; a++)
+			{
+				if (centroid_bounds[a].size() <= 0)
+					continue;
+				for (size_t i = begin; i < stop; i++)
+				{
+					int b = bin_index(items[i].centroid[a], centroid_bounds[a]);
+					bins.boxes[a][b] = aabb(bins.boxes[a][b], items[i].bbox);
+					bins.counts[a][b]++;
+				}
+			}
+		});
+		sah_bin_set bins;
+		for (const sah_bin_set& chunk : chunk_bins)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				for (int b = 0; b < sah_bins; b++)
+				{
+					bins.boxes[a][b] = aabb(bins.boxes[a][b], chunk.boxes[a][b]);
+					bins.counts[a][b] += chunk.counts[a][b];
+				}
+			}
+		}
+
+		double leaf_cost = intersect_cost * static_cast<double>(count);
+		double parent_area = box.surface_area();
+
+		// Cheapest split over all three axes
+		double best_cost = infinity;
+		int best_axis = -1;
+		int best_bin = 0;
+		for (int a = 0; a < 3; a++)
+		{
+			if (centroid_bounds[a].size() <= 0)
+				continue;
+
+			const std::array<aabb, sah_bins>& bin_boxes = bins.boxes[a];
+			const std::array<size_t, sah_bins>& bin_counts = bins.counts[a];
+
+			// Sweep from the right for the areas right of every plane, then from the left to price them
+			std::array<double, sah_bins> right_area{};
+			std::array<size_t, sah_bins> right_count{};
+			aabb side = aabb::empty;
+			size_t n = 0;
+			for (int b = sah_bins - 1; b > 0; b--)
+			{
+				side = aabb(side, bin_boxes[b]);
+				n += bin_counts[b];
+				right_area[b] = side.surface_area();
+				right_count[b] = n;
+			}
+
+			side = aabb::empty;
+			n = 0;
+			for (int b = 0; b < sah_bins - 1; b++)
+			{
+				side = aabb(side, bin_boxes[b]);
+				n += bin_counts[b];
+				if (n == 0 || right_count[b + 1] == 0)
+					continue;
+
+				double cost = traversal_cost + intersect_cost *
+					(side.surface_area() * static_cast<double>(n) +
+					 right_area[b + 1] * static_cast<double>(right_count[b + 1])) / parent_area;
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = a;
+					best_bin = b;
+				}
+			}
+		}
+
+		if (count <= max_leaf_size && leaf_cost <= best_cost)
+			return false;
+
+		if (best_axis < 0)
+		{
+			// All centroids in one spot and too many for a leaf: any halves are as good as the others
+			axis = box.longest_axis();
+			mid = start + count / 2;
+			return true;
+		}
+
+		axis = best_axis;
+		const interval& bounds = centroid_bounds[best_axis];
+		mid = partition_items(items, start, end, [&](const build_item& item)
+		{
+			return bin_index(item.centroid[best_axis], bounds) <= best_bin;
+		}, pool);
+		return true;
+	}
+
+	static int bin_index(double centroid, const interval& bounds)
+	{
+		int b = static_cast<int>(sah_bins * (centroid - bounds.min) / bounds.size());
+		return std::clamp(b, 0, sah_bins - 1);
+	}
+
+	static bvh_linear_node make_node(const aabb& box)
+	{
+		bvh_linear_node node{};
+		for (int a = 0; a < 3; a++)
+		{
+			const interval& ax = box.axis_interval(a);
+			node.min[a] = float_below(ax.min);
+			node.max[a] = float_above(ax.max);
+		}
+		return node;
+	}
+
+	/// Nearest float at most `value`
+	static float float_below(double value)
+	{
+		auto f = static_cast<float>(value);
+		return f > value ? std::nextafter(f, -INFINITY) : f;
+	}
+
+	/// Nearest float at least `value`
+	static float float_above(double value)
+	{
+		auto f = static_cast<float>(value);
+		return f < value ? std::nextafter(f, INFINITY) : f;
+	}
+
+	/// Lookup tables from objects to their leaves and from nodes to their parents, and the cost as built
+	void prepare_refit()
+	{
+		// An instance is found by its transforms, it's not an object of the scene itself
+		primitive_lookup.clear();
+		primitive_lookup.reserve(primitives.size());
+		std::vector<const hittable*> transforms;
+		for (uint32_t i = 0; i < primitives.size(); i++)
+		{
+			if (primitives[i]->get_type() != hittable_type::instance)
+			{
+				primitive_lookup.emplace_back(primitives[i], i);
+				continue;
+			}
+
+			transforms.clear();
+			static_cast<const bvh_instance*>(primitives[i])->get_transforms(transforms);
+			for (const hittable* transform : transforms)
+				primitive_lookup.emplace_back(transform, i);
+		}
+		std::sort(primitive_lookup.begin(), primitive_lookup.end());
+
+		primitive_slot.assign(primitives.size(), 0);
+		node_parent.assign(nodes.size(), no_parent);
+		lane_area = 0;
+		for (uint32_t node = 0; node < nodes.size(); node++)
+		{
+			for (int lane = 0; lane < bvh_width; lane++)
+			{
+				const bvh_wide_node& wide = nodes[node];
+				uint32_t slot = node * bvh_width + lane;
+				if (wide.count[lane] > 0)
+				{
+					for (int32_t i = wide.child[lane]; i < wide.child[lane] + wide.count[lane]; i++)
+						primitive_slot[i] = slot;
+				}
+				else if (wide.child[lane] >= 0)
+				{
+					node_parent[wide.child[lane]] = slot;
+				}
+				else
+				{
+					continue; // unused
+				}
+				lane_area += lane_box(wide, lane).surface_area();
+			}
+		}
+		bbox = lanes_box(nodes[0]);
+		built_cost = refit_cost();
+	}
+
+	/// SAH cost of the tree, short of the primitives: the chance of a ray through the root hitting a box, summed
+	[[nodiscard]] double refit_cost() const
+	{
+		return lane_area / bbox.surface_area();
+	}
+
+	static aabb lane_box(const bvh_wide_node& node, int lane)
+	{
+		return {interval(node.bounds[0][lane], node.bounds[3][lane]), interval(node.bounds[1][lane], node.bounds[4][lane]),
+		        interval(node.bounds[2][lane], node.bounds[5][lane])};
+	}
+
+	/// Union of the used lanes of `node`
+	static aabb lanes_box(const bvh_wide_node& node)
+	{
+		aabb box = aabb::empty;
+		for (int lane = 0; lane < bvh_width; lane++)
+		{
+			if (node.count[lane] > 0 || node.child[lane] >= 0)
+				box = aabb(box, lane_box(node, lane));
+		}
+		return box;
+	}
+
+	void set_lane_box(uint32_t slot, const aabb& box)
+	{
+		bvh_wide_node& node = nodes[slot / bvh_width];
+		int lane = static_cast<int>(slot % bvh_width);
+		lane_area += box.surface_area() - lane_box(node, lane).surface_area();
+		for (int a = 0; a < 3; a++)
+		{
+			const interval& ax = box.axis_interval(a);
+			node.bounds[a][lane] = float_below(ax.min);
+			node.bounds[a + 3][lane] = float_above(ax.max);
+		}
+	}
+
+	static aabb node_box(const bvh_linear_node& node)
+	{
+		return {interval(node.min[0], node.max[0]), interval(node.min[1], node.max[1]),
+		        interval(node.min[2], node.max[2])};
+	}
+
+	/// Slab test of every child box of `node` at once
+	///
+	/// Returns: A bit per child that's hit within [t_min, t_max], its entry distance in `t_near`
+	static unsigned children_hit(const bvh_wide_node& node, const ray_lanes& r, float t_min, float t_max,
+	                             float* t_near)
+	{
+#if defined(__AVX__)
+		__m256 t0 = _mm256_set1_ps(t_min);
+		__m256 t1 = _mm256_set1_ps(t_max);
+		for (int a = 0; a < 3; a++)
+		{
+			__m256 origin = _mm256_set1_ps(r.origin[a]);
+			__m256 inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+			// new value first: a NaN (0 * inf) leaves the interval as it is
+			t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.near[a]]), origin), inv_dir), t0);
+			t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.far[a]]), origin), inv_dir), t1);
+		}
+		t1 = _mm256_mul_ps(t1, _mm256_set1_ps(far_scale));
+		_mm256_storeu_ps(t_near, t0);
+		return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+#elif defined(__SSE2__)
+		__m128 t0 = _mm_set1_ps(t_min);
+		__m128 t1 = _mm_set1_ps(t_max);
+		for (int a = 0; a < 3; a++)
+		{
+			__m128 origin = _mm_set1_ps(r.origin[a]);
+			__m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+			// new value first: a NaN (0 * inf) leaves the interval as it is
+			t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.near[a]]), origin), inv_dir), t0);
+			t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.far[a]]), origin), inv_dir), t1);
+		}
+		t1 = _mm_mul_ps(t1, _mm_set1_ps(far_scale));
+		_mm_storeu_ps(t_near, t0);
+		return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(t0, t1)));
+#else
+		// Plain loops over the lanes, which compilers vectorize for NEON and the like
+		unsigned mask = 0;
+		for (int lane = 0; lane < bvh_width; lane++)
+		{
+			float t0 = t_min;
+			float t1 = t_max;
+			for (int a = 0; a < 3; a++)
+			{
+				float n = (node.bounds[r.near[a]][lane] - r.origin[a]) * r.inv_dir[a];
+				float f = (node.bounds[r.far[a]][lane] - r.origin[a]) * r.inv_dir[a];
+				t0 = n > t0 ? n : t0;
+				t1 = f < t1 ? f : t1;
+			}
+			t_near[lane] = t0;
+			if (t0 <= t1 * far_scale)
+				mask |= 1u << lane;
+		}
+		return mask;
+#endif
+	}
 };
 
 
 
-#endif //RAYTRACINGWEEKEND_BVH_H
\ No newline at end of file
+#endif //RAYTRACINGWEEKEND_BVH_H
@@ -1,8 +1,15 @@
 ﻿#ifndef RAYTRACINGWEEKEND_CAMERA_H
 #define RAYTRACINGWEEKEND_CAMERA_H
 
+#include <atomic>
+#include <chrono>
+#include <limits>
+
 #include "hittable.h"
+#include "huge_page_allocator.h"
 #include "material.h"
+#include "render_pass.h"
+#include "render_stats.h"
 
 class camera
 {
@@ -12,13 +19,11 @@ public:
 	int				image_width		= 100;   // Image width (px)
 	int				image_height	= -1;    // Image height (px)
 
-	double			basic_ratio		= 1;     // If < 1 and > 0, defines the random chance of this pixel being drawn (for multithreading)
-	double			fill_ratio		= 1;     // Random chance of neglected pixels being filled by this render cycle
 	int				dark_samples	= 0;	 // adds int(dark_influence * darkness[0~1]) of samples on top of the render
+	bool			record_cost		= false; // Also write per pixel cost (see render()), for the heatmap views, see set_record_cost()
 
-	int				sample_count	= 1;     // Number of random samples taken for each pixel for each worker
-	int				min_samples		= 5;	 // Pixels with sample count below this will be preferred in they're not rendered after a while
 	int				max_bounces		= 10;    // Maximum amount of bounces for a ray
+	uint64_t		seed			= 0;     // Same seed, same noise (see rand_pixel_seed)
 	double			bias			= 0.001; // Fix shadow acne
 	color			background		= color(0.70,0.80,1.00); // background color
 
@@ -35,27 +40,52 @@ public:
 		initialize();
 	}
 
+	/// The heatmap toggles this while workers render without restarting them, so it's only accessed atomically
+	void set_record_cost(bool record)
+	{
+		std::atomic_ref<bool>(record_cost).store(record, std::memory_order_relaxed);
+	}
+
+	[[nodiscard]] bool get_record_cost()
+	{
+		return std::atomic_ref<bool>(record_cost).load(std::memory_order_relaxed);
+	}
+
 	// bool render(const hittable& world, std::vector<float>& output)
 	// {
 	// 	bool _ = false;
 	// 	return render(world, output, _);
 	// }
 
-	bool render(const hittable& world, std::vector<float>& output, bool& early_exit, std::vector<int>& density_map, int current_sample_count)
+	/// Renders the tile of `job` with job.samples samples per pixel into `output.color` (RGB per pixel of the tile,
+	/// row by row).
+	/// If record_cost is set, `output.cost` gets nanoseconds, BVH nodes visited and primitive tests per sample for
+	/// each pixel, otherwise it's left empty.
+	///
+	/// Returns: False if cancelled through `cancel` or by a resolution change
+	bool render(const hittable& world, const tile_job& job, render_pass& output, const cancel_token& cancel,
+	            const huge_vector<int>& density_map)
 	{
-		int rendered_pixels = 0;
-		// ppm output disabled
-		// output << "P3" << '\n' << image_width << ' ' << image_height << "\n255\n"; //P3: ASCII COLORS, W&H, max value is 255
-
-		int px = 0;
+		const image_tile& tile = job.tile;
+		rng& random = rand_generator();
+		bool with_cost = get_record_cost(); // once per job
+		ray_stats& stats = render_stats::local();
 
 		int c_ih = image_height;
 		int c_iw = image_width;
+		if (tile.x + tile.width > c_iw || tile.y + tile.height > c_ih)
+			return false; // Tile of an older resolution
+
+		// Slots are reused, so once they've seen a tile this big nothing here allocates
+		output.sample_count = job.samples;
+		output.color.resize(tile.pixel_count() * 3);
+		output.cost.resize(with_cost ? tile.pixel_count() * 3 : 0);
+		float* color_out = output.color.data();
+		float* cost_out = output.cost.data();
 
-		for (int j = 0; j < c_ih; j++)
+		for (int j = tile.y; j < tile.y + tile.height; j++)
 		{
-			// std::clog << "\rScanlines remaining: " << (image_height - j) << '\n';
-			for (int i = 0; i < c_iw; i++)
+			for (int i = tile.x; i < tile.x + tile.width; i++)
 			{
 				// Resolution changed :3
 				if (c_ih != image_height || c_iw != image_width)
@@ -63,85 +93,106 @@ public:
 
 				// Per pixel operations
 				color pixel_color(0,0,0);
-
-
-				// for pixel ratio, prioritize drawing pixels with less data
-				// what a hellish algorithm :)
-				bool render_pixel = false;
-				if (basic_ratio < 0 || basic_ratio >= 1)
-					render_pixel = true;
-				else if (current_sample_count > (min_samples / basic_ratio))
+				size_t pixel = static_cast<size_t>(j) * c_iw + i;
+				size_t px = pixel * 3; // TODO: change if channel count changes
+				random.seed(rand_pixel_seed(seed, pixel, job.round));
+
+				int new_sample_count = job.samples;
+				std::chrono::steady_clock::time_point cost_start;
+				ray_stats_totals stats_start;
+				if (with_cost)
 				{
-					if (px < density_map.size())
-					{
-						if (density_map[px] < min_samples)
-							if (rand_double() < fill_ratio)
-							render_pixel = true;
-					} else
-					{
-						// Resolution probably changed, doesn't really matter since early exit will be called
-						std::clog << "PX EXCEEDS DENSITY MAP\n";
-					}
+					cost_start = std::chrono::steady_clock::now();
+					stats_start.bvh_nodes = stats.bvh_nodes.load(std::memory_order_relaxed);
+					stats_start.primitive_tests = stats.primitive_tests.load(std::memory_order_relaxed);
 				}
-				if (rand_double() < basic_ratio) // another chance / default
-					render_pixel = true;
 
-
-				int new_sample_count = sample_count;
-				if (render_pixel)
+				for (int sample = 0; sample < new_sample_count; sample++)
 				{
-					rendered_pixels++;
-					for (int sample = 0; sample < new_sample_count; sample++)
-					{
-						// Early exit
-						if (early_exit)
-						{
-							std::wclog << "EARLY EXIT!" << '\n';
-							return false; // Render cancelled
-						}
+					// Early exit
+					if (cancel.is_cancelled(job))
+						return false; // Render cancelled
 
-						// Per sample operations here!
+					// Per sample operations here!
 
-						// technically HDR supported
-						ray r = get_ray(i, j);
-						pixel_color += ray_color(r, max_bounces, world);
+					// technically HDR supported
+					ray r = get_ray(i, j);
+					pixel_color += ray_color(r, max_bounces, world);
 
-						if (dark_samples != 0 && sample == 0) // recalc sample count
+					if (dark_samples != 0 && sample == 0) // recalc sample count
+					{
+						// skip if first sample to improve responsiveness
+						if (px < density_map.size() && density_map[px] < 2) // 1 or 2 sample
+						{
+							// pass
+						}
+						else
 						{
-							// skip if first sample to improve responsiveness
-							if (px < density_map.size() && density_map[px] < 2) // 1 or 2 sample
-							{
-								// pass
-							}
-							else
-							{
-								double darkness = 1 - pixel_color.length(); // sqrt shouldn't be too big of a performance hit, run once per pixel
-								// clamp
-								darkness = std::clamp(darkness, 0.0, 1.0);
-								new_sample_count += static_cast<int>(dark_samples * darkness);
-							}
+							double darkness = 1 - pixel_color.length(); // sqrt shouldn't be too big of a performance hit, run once per pixel
+							// clamp
+							darkness = std::clamp(darkness, 0.0, 1.0);
+							new_sample_count += static_cast<int>(dark_samples * darkness);
 						}
 					}
-				} else
-				{
-					pixel_color = color(-1,-1,-1); // -1 = SKIPPED
 				}
 
 				double sample_contribution = 1.0 / new_sample_count;
 
-				write_color(output, sample_contribution * pixel_color);
-				px+=3; // TODO: change if channel count changes
+				write_color(color_out, sample_contribution * pixel_color);
+				color_out += 3;
+				if (with_cost)
+				{
+					std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - cost_start;
+					auto nodes = stats.bvh_nodes.load(std::memory_order_relaxed) - stats_start.bvh_nodes;
+					auto tests = stats.primitive_tests.load(std::memory_order_relaxed) - stats_start.primitive_tests;
+					write_color(cost_out, sample_contribution * color(elapsed.count(), nodes, tests));
+					cost_out += 3;
+				}
 			}
 		}
 
-		// prevent overloading queue, should not impact quality too much
-		if (rendered_pixels < 40)
-			return false;
-
-		// std::clog << "\rDone.                 \n";
 		return true; // Finished successfully!
 	}
 
+	/// Pixel rectangle covering `box` on screen, clamped to the image. A box reaching behind the camera covers the
+	/// whole image. Only valid after ready()
+	///
+	/// Returns: False if the box is off screen
+	bool project_box(const aabb& box, image_tile& rect) const
+	{
+		double min_x = std::numeric_limits<double>::infinity(), min_y = min_x;
+		double max_x = -min_x, max_y = -min_x;
+		for (int corner = 0; corner < 8; corner++)
+		{
+			point3 p((corner & 1) ? box.x.max : box.x.min,
+			         (corner & 2) ? box.y.max : box.y.min,
+			         (corner & 4) ? box.z.max : box.z.min);
+			vec3 d = p - center;
+			double depth = dot(d, -w);
+			if (depth < 1e-6)
+			{
+				rect = {0, 0, image_width, image_height};
+				return true;
+			}
+
+			// Onto the focus plane, then into pixels (pixel00_loc is the center of pixel 0)
+			vec3 rel = d * (focus_distance / depth) - (pixel00_loc - center);
+			double px = dot(rel, pixel_delta_u) / pixel_delta_u.length_squared() + 0.5;
+			double py = dot(rel, pixel_delta_v) / pixel_delta_v.length_squared() + 0.5;
+			min_x = std::min(min_x, px);
+			min_y = std::min(min_y, py);
+			max_x = std::max(max_x, px);
+			max_y = std::max(max_y, py);
+		}
+
+		int x0 = std::clamp(static_cast<int>(std::floor(min_x)), 0, image_width);
+		int y0 = std::clamp(static_cast<int>(std::floor(min_y)), 0, image_height);
+		int x1 = std::clamp(static_cast<int>(std::ceil(max_x)), 0, image_width);
+		int y1 = std::clamp(static_cast<int>(std::ceil(max_y)), 0, image_height);
+		rect = {x0, y0, x1 - x0, y1 - y0};
+		return rect.width > 0 && rect.height > 0;
+	}
+
 private:
 	// int		image_height = 0;	// [DEPRECATED] Image height (px)
 	// double	sample_contribution = 0; // [DEPRECATED] the factor of each sample's influence on the pixel
@@ -230,13 +281,24 @@ private:
 
 	color ray_color(const ray& r, int depth, const hittable& world) const
 	{
+		ray_stats& stats = render_stats::local();
+		int bounces = max_bounces - depth;
+
 		if (depth <= 0)
+		{
+			stats.add_depth(bounces);
 			return {0,0,0}; // TODO: Should be able to modify ambient light from world
+		}
 
 		hit_record rec;
 
+		stat_add(stats.rays);
 		if (!world.hit(r, interval(bias, infinity), rec))
+		{
+			stats.add_depth(bounces);
 			return background;
+		}
+		stat_add(stats.hits);
 
 
 		ray scattered;
@@ -244,7 +306,11 @@ private:
 		color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
 
 		if (!rec.mat->scatter(r, rec, attenuation, scattered))
+		{
+			stats.add_depth(bounces);
 			return color_from_emission;
+		}
+		stat_add(stats.scatters);
 
 
 		color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
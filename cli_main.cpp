@@ -0,0 +1,252 @@
+﻿#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "image_writer.h"
+#include "render_stats.h"
+#include "scene.h"
+#include "scene_presets.h"
+#include "thread_affinity.h"
+#include "trace.h"
+#include "viewport.h"
+
+// Headless renderer: no window, no OpenGL. Renders a preset scene on all cores and writes the result to disk.
+
+static void print_usage()
+{
+	std::cout << "Usage: raytrack_cli [options]\n"
+		<< "  --scene <name>      Preset scene: empty, sky, cornell, chrome, spheres, dark (default: cornell)\n"
+		<< "  --width <px>        Image width (default: the preset's resolution)\n"
+		<< "  --height <px>       Image height (default: the preset's resolution)\n"
+		<< "  --samples <n>       Samples per pixel to render (default: 64)\n"
+		<< "  --time <seconds>    Render for this long instead of a fixed sample count\n"
+		<< "  --threads <n|auto>  Render threads, auto tunes the count while rendering (default: all usable cores)\n"
+		<< "  --pin <on|off>      Pin each render thread to its own core (default: off)\n"
+		<< "  --bounces <n>       Max ray bounces (default: 20)\n"
+		<< "  --bvh <median|sah>  BVH build: median split or surface area heuristic (default: sah)\n"
+		<< "  --seed <n>          Random seed, the same seed gives the same image on any thread count (default: 0)\n"
+		<< "  --output <file>     Output image. .ppm is written as 8-bit SDR, anything else as linear .pfm (default: render.pfm)\n"
+		<< "  --heatmap <cost>    Write a false color cost image instead: time, bvh or primitives\n"
+		<< "  --stats <file>      Write ray statistics (rays, BVH nodes, primitive tests, bounce depths) as JSON\n"
+		<< "  --trace <file>      Record a timeline of the render pipeline (chrome://tracing / Perfetto JSON)\n";
+}
+
+int main(int argc, char* argv[])
+{
+	scene_preset preset = Cornell;
+	int width = -1;
+	int height = -1;
+	int samples = 64;
+	double time_budget = 0;
+	int threads = thread_affinity::usable_cpu_count();
+	bool auto_threads = false;
+	bool pin = false;
+	bvh_build bvh = Bvh_sah;
+	int bounces = 20;
+	uint64_t seed = 0;
+	std::string output = "render.pfm";
+	std::string stats_output;
+	std::string trace_output;
+	display_mode heatmap = Display_color;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+		{
+			print_usage();
+			return EXIT_SUCCESS;
+		}
+
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << '\n';
+			print_usage();
+			return EXIT_FAILURE;
+		}
+		std::string value = argv[++i];
+
+		try
+		{
+			if (arg == "--scene")
+			{
+				if (!scene_preset_from_name(value, preset))
+				{
+					std::cerr << "Unknown scene: " << value << '\n';
+					return EXIT_FAILURE;
+				}
+			}
+			else if (arg == "--width") width = std::stoi(value);
+			else if (arg == "--height") height = std::stoi(value);
+			else if (arg == "--samples") samples = std::stoi(value);
+			else if (arg == "--time") time_budget = std::stod(value);
+			else if (arg == "--threads" && value == "auto") auto_threads = true;
+			else if (arg == "--threads") threads = std::stoi(value);
+			else if (arg == "--pin")
+			{
+				if (value == "on") pin = true;
+				else if (value == "off") pin = false;
+				else
+				{
+					std::cerr << "Invalid value for --pin: " << value << '\n';
+					return EXIT_FAILURE;
+				}
+			}
+			else if (arg == "--bounces") bounces = std::stoi(value);
+			else if (arg == "--bvh")
+			{
+				if (value == "median") bvh = Bvh_median;
+				else if (value == "sah") bvh = Bvh_sah;
+				else
+				{
+					std::cerr << "Unknown BVH build: " << value << '\n';
+					return EXIT_FAILURE;
+				}
+			}
+			else if (arg == "--seed") seed = std::stoull(value);
+			else if (arg == "--output") output = value;
+			else if (arg == "--stats") stats_output = value;
+			else if (arg == "--trace") trace_output = value;
+			else if (arg == "--heatmap")
+			{
+				if (value == "time") heatmap = Display_time;
+				else if (value == "bvh") heatmap = Display_bvh_nodes;
+				else if (value == "primitives") heatmap = Display_primitive_tests;
+				else
+				{
+					std::cerr << "Unknown heatmap: " << value << '\n';
+					return EXIT_FAILURE;
+				}
+			}
+			else
+			{
+				std::cerr << "Unknown option: " << arg << '\n';
+				print_usage();
+				return EXIT_FAILURE;
+			}
+		}
+		catch (const std::exception&)
+		{
+			std::cerr << "Invalid value for " << arg << ": " << value << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (threads < 1) threads = 1;
+	if (samples < 1) samples = 1;
+
+	trace::set_thread_name("main");
+	if (!trace_output.empty())
+		trace::start();
+
+	rand_seed(seed); // some presets are randomly generated
+	scene scn = preset_scene_creator::create_scene(preset);
+	if (width <= 0) width = scn.s_camera.image_width;
+	if (height <= 0) height = scn.s_camera.image_height;
+
+	// Build the BVH before any worker touches the scene
+	scn.set_bvh_build(bvh);
+	scn.update();
+
+	// Start without workers, so no render is wasted on the default settings
+	viewport vp(std::move(scn), width, height, 0, true);
+	vp.set_max_bounces(bounces);
+	vp.set_sample_count(1);
+	vp.set_seed(seed);
+	vp.set_display_mode(heatmap);
+	vp.set_pin_workers(pin);
+	if (time_budget <= 0)
+		vp.set_sample_limit(samples);
+	vp.update(); // apply settings
+	render_stats::reset();
+	if (auto_threads)
+		vp.set_auto_workers(true);
+	else
+		vp.set_worker_count(threads);
+
+	std::clog << "Rendering " << scene_preset_get_name(preset) << " at " << width << " x " << height
+		<< " with " << vp.get_workers_count() << (auto_threads ? " threads (auto)\n" : " threads\n");
+
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = [&start]
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	while (true)
+	{
+		vp.update();
+
+		bool finished = time_budget > 0
+			                ? elapsed() >= time_budget
+			                : vp.get_current_sample_count() >= samples;
+		if (finished)
+			break;
+
+		if (!vp.has_backlog())
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// Stop rendering, then merge whatever is still queued. Auto threads may have changed the count along the way
+	int rendered_threads = vp.get_workers_count();
+	vp.set_worker_count(0, true);
+	while (vp.has_backlog())
+		vp.update();
+
+	double seconds = elapsed();
+	std::clog << "Rendered " << vp.get_current_sample_count() << " samples per pixel in " << seconds << "s\n";
+
+	std::vector<float> image = vp.get_image();
+	if (heatmap != Display_color)
+	{
+		float scale;
+		image = vp.get_heatmap(heatmap, scale);
+		for (float& value : image)
+			value = gamma_to_linear(value); // write_image expects linear values
+		std::clog << "Heatmap: red = " << scale << ' ' << display_mode_get_unit(heatmap) << " per sample\n";
+	}
+
+	if (!write_image(output, image, vp.get_width(), vp.get_height()))
+	{
+		std::cerr << "Failed to write " << output << '\n';
+		return EXIT_FAILURE;
+	}
+
+	std::clog << "Saved to " << output << '\n';
+
+	if (!trace_output.empty())
+	{
+		trace::stop();
+		if (!trace::write(trace_output))
+		{
+			std::cerr << "Failed to write " << trace_output << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!stats_output.empty())
+	{
+		std::ofstream file(stats_output);
+		if (!file)
+		{
+			std::cerr << "Failed to write " << stats_output << '\n';
+			return EXIT_FAILURE;
+		}
+
+		json_writer json(file);
+		json.begin_object();
+		json.field("scene", scene_preset_get_name(preset));
+		json.field("width", vp.get_width()); // what was rendered, the viewport may have rejected the requested size
+		json.field("height", vp.get_height());
+		json.field("samples", vp.get_current_sample_count());
+		json.field("threads", rendered_threads);
+		json.field("auto_threads", auto_threads);
+		json.field("seconds", seconds);
+		json.key("stats");
+		render_stats::collect().write_json(json);
+		json.end_object();
+	}
+	return EXIT_SUCCESS;
+}
@@ -1,9 +1,16 @@
 ﻿#ifndef COLOR_H
 #define COLOR_H
 
+#include <algorithm>
+#include <cstdint>
+
 #include "interval.h"
 #include "vec3.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using color = vec3;
 
 // approximation: gamma 2 inverse
@@ -17,12 +24,69 @@ inline float linear_to_gamma(float linear_intensity)
 	return 0;
 }
 
+/// out[i] = linear_to_gamma(sum[i] / count[i]), 0 where count is 0 (sum is 0 there too). Branch free, 4 at a time
+/// with SSE2
+inline void normalize_to_gamma(const float* sum, const int* count, float* out, size_t n)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128 zero = _mm_setzero_ps();
+	const __m128i one = _mm_set1_epi32(1);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(count + i));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi32(c, _mm_setzero_si128()), one)); // 0 -> 1
+		__m128 v = _mm_div_ps(_mm_loadu_ps(sum + i), _mm_cvtepi32_ps(c));
+		_mm_storeu_ps(out + i, _mm_sqrt_ps(_mm_max_ps(v, zero)));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = linear_to_gamma(sum[i] / static_cast<float>(std::max(count[i], 1)));
+}
+
+/// normalize_to_gamma() for `pixels` RGB pixels, packed as RGBA8 (alpha 255) into `out`. `scratch` holds pixels * 3
+inline void normalize_to_rgba8(const float* sum, const int* count, uint8_t* out, size_t pixels, float* scratch)
+{
+	normalize_to_gamma(sum, count, scratch, pixels * 3);
+	for (size_t px = 0; px < pixels; px++)
+	{
+		for (int c = 0; c < 3; c++)
+			out[px * 4 + c] = static_cast<uint8_t>(std::min(scratch[px * 3 + c], 1.0f) * 255.0f + 0.5f);
+		out[px * 4 + 3] = 255;
+	}
+}
+
+/// Inverse of linear_to_gamma
+inline float gamma_to_linear(float gamma_intensity)
+{
+	return gamma_intensity * gamma_intensity;
+}
+
 inline float to_sdr(float intensity)
 {
 	static const interval sdr_range(0.000, 1.000);
 	return sdr_range.clamp(linear_to_gamma(intensity));
 }
 
+/// False color ramp for the heatmap views: t = 0 (cheap) is dark blue, then cyan, green, yellow, t = 1 (expensive) is red.
+/// Returns display (gamma) values
+inline color heatmap_color(double t)
+{
+	static const color stops[] = {
+		color(0.05, 0.05, 0.35),
+		color(0.00, 0.60, 0.90),
+		color(0.10, 0.80, 0.20),
+		color(0.95, 0.90, 0.10),
+		color(0.90, 0.10, 0.05),
+	};
+	constexpr int last = sizeof(stops) / sizeof(stops[0]) - 1;
+
+	t = std::clamp(t, 0.0, 1.0) * last;
+	int i = std::min(static_cast<int>(t), last - 1);
+	double f = t - i;
+	return (1 - f) * stops[i] + f * stops[i + 1];
+}
+
 inline void write_color(std::vector<float>& out, const color& pixel_color)
 {
 	// auto r = pixel_color.x();
@@ -42,4 +106,12 @@ inline void write_color(std::vector<float>& out, const color& pixel_color)
 	out.push_back(static_cast<float>(pixel_color.y()));
 	out.push_back(static_cast<float>(pixel_color.z()));
 }
+
+/// Writes one RGB pixel to `out[0..2]`, for buffers sized up front
+inline void write_color(float* out, const color& pixel_color)
+{
+	out[0] = static_cast<float>(pixel_color.x());
+	out[1] = static_cast<float>(pixel_color.y());
+	out[2] = static_cast<float>(pixel_color.z());
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,88 @@
+﻿#include "frame_pool.h"
+
+#include <algorithm>
+
+frame_pool::frame_pool(int helpers)
+{
+	for (int i = 0; i < helpers; i++)
+		threads.emplace_back(&frame_pool::helper_loop, this);
+}
+
+frame_pool::~frame_pool()
+{
+	{
+		std::lock_guard lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+void frame_pool::parallel_for(size_t count, size_t min_chunk, const std::function<void(size_t, size_t)>& fn)
+{
+	if (count == 0)
+		return;
+
+	// A few chunks per thread, so an uneven chunk doesn't leave the others waiting
+	size_t chunk = std::max(min_chunk, count / (get_thread_count() * 4) + 1);
+	if (threads.empty() || chunk >= count)
+	{
+		fn(0, count);
+		return;
+	}
+
+	{
+		std::lock_guard lock(mutex);
+		this->fn = &fn;
+		this->count = count;
+		this->chunk = chunk;
+		next = 0;
+		busy = static_cast<int>(threads.size());
+		job++;
+	}
+	wake.notify_all();
+
+	run_chunks();
+
+	std::unique_lock lock(mutex);
+	done.wait(lock, [this] { return busy == 0; });
+	this->fn = nullptr;
+}
+
+void frame_pool::helper_loop()
+{
+	uint64_t seen = 0;
+	while (true)
+	{
+		{
+			std::unique_lock lock(mutex);
+			wake.wait(lock, [&] { return stop || job != seen; });
+			if (stop)
+				return;
+			seen = job;
+		}
+
+		run_chunks();
+
+		std::lock_guard lock(mutex);
+		if (--busy == 0)
+			done.notify_one();
+	}
+}
+
+void frame_pool::run_chunks()
+{
+	while (true)
+	{
+		size_t begin;
+		{
+			std::lock_guard lock(mutex);
+			if (next >= count)
+				return;
+			begin = next;
+			next = std::min(next + chunk, count);
+		}
+		(*fn)(begin, std::min(begin + chunk, count));
+	}
+}
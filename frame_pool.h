@@ -0,0 +1,53 @@
+﻿#ifndef RAYTRACINGWEEKEND_FRAME_POOL_H
+#define RAYTRACINGWEEKEND_FRAME_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A few helper threads for the per frame work of the viewport (merging tiles, tonemapping), so the UI thread isn't
+/// the bottleneck with many render workers. The calling thread works along, with no helpers everything runs inline.
+class frame_pool
+{
+public:
+	explicit frame_pool(int helpers);
+	~frame_pool();
+
+	frame_pool(const frame_pool&) = delete;
+	frame_pool& operator=(const frame_pool&) = delete;
+
+	/// Calls `fn(begin, end)` for chunks of [0, count) of at least `min_chunk`, on the helpers and the calling thread.
+	/// Returns when every chunk is done. Only one thread may call it at a time
+	void parallel_for(size_t count, size_t min_chunk, const std::function<void(size_t, size_t)>& fn);
+
+	[[nodiscard]] int get_thread_count() const
+	{
+		return static_cast<int>(threads.size()) + 1;
+	}
+
+private:
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable wake;   // helpers wait for a job
+	std::condition_variable done;   // the caller waits for the helpers
+	bool stop = false;
+	uint64_t job = 0;               // bumped for each parallel_for
+	int busy = 0;                   // helpers still on the current job
+
+	const std::function<void(size_t, size_t)>* fn = nullptr;
+	size_t count = 0;
+	size_t chunk = 0;
+	size_t next = 0;                // next chunk start, under mutex
+
+	void helper_loop();
+
+	/// Takes chunks until there are none left
+	void run_chunks();
+};
+
+#endif //RAYTRACINGWEEKEND_FRAME_POOL_H
@@ -2,6 +2,7 @@
 #define RAYTRACINGWEEKEND_HITTABLE_H
 #include "aabb.h"
 #include "material.h"
+#include "rigid_transform.h"
 
 class scene;
 class viewport;
@@ -16,7 +17,8 @@ enum hittable_type
 	volume,
 	mover,
 	rotator,
-	bvh
+	bvh,
+	instance
 };
 
 class hit_record
@@ -71,6 +73,9 @@ public:
 
 	case bvh:
 		return "BVH-Optimized Node";
+
+	case instance:
+		return "BVH Instance";
 	}
 
 	return "Unknown";
@@ -89,6 +94,11 @@ public:
 
 	virtual hittable_type get_type() const = 0;
 
+	/// Transforms only: how `object` is placed in the space around this
+	///
+	/// Returns: False if this isn't a transform
+	virtual bool get_placement(rigid_transform& /*transform*/, shared_ptr<hittable>& /*object*/) const {return false;}
+
 	[[nodiscard]] std::string get_human_type() const
 	{
 		return hittable_get_human_type(get_type());
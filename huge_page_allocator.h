@@ -0,0 +1,82 @@
+﻿#ifndef RAYTRACINGWEEKEND_HUGE_PAGE_ALLOCATOR_H
+#define RAYTRACINGWEEKEND_HUGE_PAGE_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/// Allocator for big buffers that are walked over and over (framebuffers, acceleration structures).
+/// Allocations of at least one huge page are aligned to it and marked for transparent huge pages, so they need a
+/// fraction of the TLB entries. Smaller ones, and anything outside Linux, are plain operator new.
+/// resize() leaves new elements of trivial types unwritten, so the thread that fills them first decides which NUMA
+/// node their pages land on.
+template <typename T>
+class huge_page_allocator
+{
+public:
+	using value_type = T;
+
+	static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+	huge_page_allocator() = default;
+
+	template <typename U>
+	huge_page_allocator(const huge_page_allocator<U>&) noexcept {}
+
+	T* allocate(size_t n)
+	{
+		size_t bytes = n * sizeof(T);
+#ifdef __linux__
+		if (bytes >= huge_page_size)
+		{
+			size_t rounded = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+			void* p = std::aligned_alloc(huge_page_size, rounded);
+			if (!p)
+				throw std::bad_alloc();
+			madvise(p, rounded, MADV_HUGEPAGE); // only a hint, fine if THP is off
+			return static_cast<T*>(p);
+		}
+#endif
+		return static_cast<T*>(::operator new(bytes));
+	}
+
+	void deallocate(T* p, size_t n) noexcept
+	{
+#ifdef __linux__
+		if (n * sizeof(T) >= huge_page_size)
+		{
+			std::free(p);
+			return;
+		}
+#endif
+		::operator delete(p);
+	}
+
+	/// Default- instead of value-initialized
+	template <typename U>
+	void construct(U* p)
+	{
+		::new (static_cast<void*>(p)) U;
+	}
+
+	template <typename U, typename... Args>
+	void construct(U* p, Args&&... args)
+	{
+		::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+	}
+
+	template <typename U>
+	bool operator==(const huge_page_allocator<U>&) const noexcept { return true; }
+};
+
+/// std::vector backed by huge pages once it's big enough
+template <typename T>
+using huge_vector = std::vector<T, huge_page_allocator<T>>;
+
+#endif //RAYTRACINGWEEKEND_HUGE_PAGE_ALLOCATOR_H
@@ -0,0 +1,66 @@
+﻿#ifndef RAYTRACINGWEEKEND_IMAGE_WRITER_H
+#define RAYTRACINGWEEKEND_IMAGE_WRITER_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "misc.h"
+
+/// Writes linear RGB float data as a Portable Float Map (.pfm). No tonemapping, HDR values are kept.
+/// Returns true if the file was written
+inline bool write_pfm(const std::string& filename, const std::vector<float>& rgb, int width, int height)
+{
+	if (rgb.size() != static_cast<size_t>(width) * height * 3)
+		return false;
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out)
+		return false;
+
+	// negative scale = little endian
+	out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+
+	// PFM stores scanlines bottom to top
+	for (int j = height - 1; j >= 0; j--)
+	{
+		out.write(reinterpret_cast<const char*>(rgb.data() + static_cast<size_t>(j) * width * 3),
+		          static_cast<std::streamsize>(width * 3 * sizeof(float)));
+	}
+
+	return static_cast<bool>(out);
+}
+
+/// Writes linear RGB float data as a binary 8-bit PPM (.ppm), gamma corrected the same way as the viewport
+/// Returns true if the file was written
+inline bool write_ppm(const std::string& filename, const std::vector<float>& rgb, int width, int height)
+{
+	if (rgb.size() != static_cast<size_t>(width) * height * 3)
+		return false;
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out)
+		return false;
+
+	out << "P6\n" << width << ' ' << height << "\n255\n";
+
+	std::vector<unsigned char> bytes(rgb.size());
+	for (size_t i = 0; i < rgb.size(); i++)
+	{
+		bytes[i] = static_cast<unsigned char>(255.999f * to_sdr(rgb[i]));
+	}
+	out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+
+	return static_cast<bool>(out);
+}
+
+/// Picks the format from the file extension: .ppm is written as 8-bit SDR, everything else as linear .pfm
+inline bool write_image(const std::string& filename, const std::vector<float>& rgb, int width, int height)
+{
+	if (filename.size() >= 4 && filename.substr(filename.size() - 4) == ".ppm")
+		return write_ppm(filename, rgb, width, height);
+
+	return write_pfm(filename, rgb, width, height);
+}
+
+#endif //RAYTRACINGWEEKEND_IMAGE_WRITER_H
@@ -0,0 +1,114 @@
+﻿#ifndef RAYTRACINGWEEKEND_JSON_WRITER_H
+#define RAYTRACINGWEEKEND_JSON_WRITER_H
+
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// Minimal streaming JSON writer for the benchmark/statistics dumps. Handles commas and indentation, nothing else.
+class json_writer
+{
+public:
+	explicit json_writer(std::ostream& out) : out(out) {}
+
+	void begin_object() { open('{'); }
+	void end_object() { close('}'); }
+	void begin_array() { open('['); }
+	void end_array() { close(']'); }
+
+	/// Next value will be stored under this key. Only valid inside objects
+	void key(const std::string& name)
+	{
+		separate();
+		write_string(name);
+		out << ": ";
+		after_key = true;
+	}
+
+	void value(const std::string& v) { separate(); write_string(v); }
+	void value(const char* v) { value(std::string(v)); }
+	void value(bool v) { separate(); out << (v ? "true" : "false"); }
+	void value(int v) { separate(); out << v; }
+	void value(int64_t v) { separate(); out << v; }
+	void value(uint64_t v) { separate(); out << v; }
+
+	void value(double v)
+	{
+		separate();
+		if (std::isfinite(v)) out << v;
+		else out << "null"; // JSON has no inf/nan
+	}
+
+	template <typename T>
+	void field(const std::string& name, const T& v)
+	{
+		key(name);
+		value(v);
+	}
+
+private:
+	std::ostream& out;
+	std::vector<bool> has_items; // one entry per open object/array
+	bool after_key = false;
+
+	void open(char bracket)
+	{
+		separate();
+		out << bracket;
+		has_items.push_back(false);
+	}
+
+	void close(char bracket)
+	{
+		bool had_items = has_items.back();
+		has_items.pop_back();
+		if (had_items)
+			newline();
+		out << bracket;
+		if (has_items.empty())
+			out << '\n';
+	}
+
+	/// Comma + newline before every item but the first of its parent
+	void separate()
+	{
+		if (after_key)
+		{
+			after_key = false;
+			return;
+		}
+		if (has_items.empty())
+			return;
+
+		if (has_items.back())
+			out << ',';
+		has_items.back() = true;
+		newline();
+	}
+
+	void newline()
+	{
+		out << '\n' << std::string(has_items.size() * 2, ' ');
+	}
+
+	void write_string(const std::string& s)
+	{
+		out << '"';
+		for (char c : s)
+		{
+			switch (c)
+			{
+			case '"': out << "\\\""; break;
+			case '\\': out << "\\\\"; break;
+			case '\n': out << "\\n"; break;
+			case '\t': out << "\\t"; break;
+			default: out << c;
+			}
+		}
+		out << '"';
+	}
+};
+
+#endif //RAYTRACINGWEEKEND_JSON_WRITER_H
@@ -1,14 +1,15 @@
 ﻿#ifndef RAYTRACINGWEEKEND_RTWEEKEND_H
 #define RAYTRACINGWEEKEND_RTWEEKEND_H
 
+#include <cstdint>
 #include <limits>
 #include <memory>
 #include <cmath>
 #include <iostream>
 #include <fstream>
-#include <random>
 #include <format>
 #include <algorithm>
+#include <vector>
 
 // C++ std usings
 using std::make_shared;
@@ -24,14 +25,85 @@ inline double deg_to_rad(double deg)
 	return deg * pi / 180.0;
 }
 
+/// SplitMix64 step, used to expand and mix seeds
+constexpr uint64_t splitmix64(uint64_t& state)
+{
+	uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+/// xoshiro256+ generator: 32 bytes of state, a handful of instructions per number.
+/// The top 53 bits are good enough for doubles, which is all it's used for
+class rng
+{
+public:
+	constexpr rng() : rng(0) {}
+
+	explicit constexpr rng(uint64_t seed)
+	{
+		this->seed(seed);
+	}
+
+	constexpr void seed(uint64_t seed)
+	{
+		for (uint64_t& word : s)
+			word = splitmix64(seed);
+	}
+
+	constexpr uint64_t next()
+	{
+		const uint64_t result = s[0] + s[3];
+		const uint64_t t = s[1] << 17;
+
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = (s[3] << 45) | (s[3] >> 19);
+
+		return result;
+	}
+
+	/// [0, 1)
+	constexpr double next_double()
+	{
+		return static_cast<double>(next() >> 11) * 0x1.0p-53;
+	}
+
+private:
+	uint64_t s[4] = {};
+};
+
+/// The calling thread's generator. Constant initialized, so no thread_local init guard on the hot path
+inline rng& rand_generator()
+{
+	thread_local constinit rng generator(0);
+	return generator;
+}
+
+/// Restarts the calling thread's random sequence, for reproducible results
+inline void rand_seed(uint64_t seed)
+{
+	rand_generator().seed(seed);
+}
+
+/// Seed for one pixel of one round (see tile_job::round). Renders reseed per pixel with this, so every pixel sample
+/// gets the same random numbers no matter which thread renders it or in which order
+inline uint64_t rand_pixel_seed(uint64_t seed, uint64_t pixel, uint64_t round)
+{
+	uint64_t state = seed;
+	state ^= splitmix64(pixel);
+	state ^= splitmix64(round) << 1;
+	return splitmix64(state);
+}
+
 /// Returns random double from [0, 1).
 inline double rand_double()
 {
-	// c++ 11+
-	static std::uniform_real_distribution<double> distribution(0.0, 1.0); // [0, 1)
-	static std::mt19937 generator;
-
-	return distribution(generator);
+	return rand_generator().next_double();
 }
 
 /// Returns random double from [min, max).
@@ -0,0 +1,104 @@
+﻿#ifndef RAYTRACINGWEEKEND_MPSC_RING_H
+#define RAYTRACINGWEEKEND_MPSC_RING_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/// Bounded lock-free queue, any number of threads push and one thread pops.
+///
+/// Every cell carries a sequence number telling whose turn it is: pushers claim a cell by advancing `tail`, fill it and
+/// publish it by bumping its sequence, the consumer frees it again by bumping the sequence a lap ahead. A full ring
+/// makes try_push fail instead of overwriting or growing, the caller decides how to wait (back-pressure).
+template <typename T, size_t Capacity>
+class mpsc_ring
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	mpsc_ring()
+	{
+		for (size_t i = 0; i < Capacity; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	mpsc_ring(const mpsc_ring&) = delete;
+	mpsc_ring& operator=(const mpsc_ring&) = delete;
+
+	/// Any thread.
+	///
+	/// Returns: False if the ring is full, `value` wasn't queued
+	bool try_push(const T& value)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell& c = cells[pos & mask];
+			size_t sequence = c.sequence.load(std::memory_order_acquire);
+			auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+			if (diff == 0)
+			{
+				// Free cell, claim it (on failure pos is reloaded)
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					c.value = value;
+					c.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // still holds a value from the last lap
+			}
+			else
+			{
+				pos = tail.load(std::memory_order_relaxed); // someone else claimed it
+			}
+		}
+	}
+
+	/// Consumer thread only.
+	///
+	/// Returns: False if there's nothing (published) to take
+	bool try_pop(T& value)
+	{
+		cell& c = cells[head & mask];
+		size_t sequence = c.sequence.load(std::memory_order_acquire);
+		if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(head + 1) < 0)
+			return false;
+
+		value = c.value;
+		c.sequence.store(head + Capacity, std::memory_order_release);
+		head++;
+		return true;
+	}
+
+	/// Consumer thread only. A push that's in progress counts as empty
+	[[nodiscard]] bool empty() const
+	{
+		const cell& c = cells[head & mask];
+		return c.sequence.load(std::memory_order_acquire) != head + 1;
+	}
+
+	[[nodiscard]] static constexpr size_t capacity()
+	{
+		return Capacity;
+	}
+
+private:
+	static constexpr size_t mask = Capacity - 1;
+
+	struct cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::array<cell, Capacity> cells;
+	alignas(64) std::atomic<size_t> tail{0}; // next cell to push, shared by producers
+	alignas(64) size_t head = 0;             // next cell to pop, consumer only
+};
+
+#endif //RAYTRACINGWEEKEND_MPSC_RING_H
@@ -0,0 +1,60 @@
+﻿#include "pbo_ring.h"
+
+void* pbo_ring::map(size_t bytes)
+{
+	if (buffers[0] == 0)
+		glGenBuffers(ring_size, buffers);
+
+	int index = next;
+	if (fences[index])
+	{
+		// Timeout 0: only asks, never waits
+		GLenum status = glClientWaitSync(fences[index], 0, 0);
+		if (status == GL_TIMEOUT_EXPIRED)
+			return nullptr;
+		glDeleteSync(fences[index]);
+		fences[index] = nullptr;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[index]);
+	if (sizes[index] != bytes)
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, static_cast<GLsizeiptr>(bytes), nullptr, GL_STREAM_DRAW);
+		sizes[index] = bytes;
+	}
+
+	// The fence said the GPU is done, so no need for the driver to synchronize (or copy) again
+	void* data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, static_cast<GLsizeiptr>(bytes),
+	                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!data)
+		return nullptr;
+
+	mapped = index;
+	return data;
+}
+
+void pbo_ring::upload(GLuint texture, const std::vector<image_tile>& rects, GLenum format, GLenum type,
+                      size_t bytes_per_pixel)
+{
+	if (mapped < 0)
+		return;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[mapped]);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	// With a buffer bound, the pointer is an offset into it and the copy happens on the GPU's time
+	glBindTexture(GL_TEXTURE_2D, texture);
+	size_t offset = 0;
+	for (const image_tile& rect : rects)
+	{
+		glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.width, rect.height, format, type,
+		                reinterpret_cast<const void*>(offset));
+		offset += static_cast<size_t>(rect.pixel_count()) * bytes_per_pixel;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // other uploads (glTexImage2D on resize) read client memory
+
+	fences[mapped] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	next = (mapped + 1) % ring_size;
+	mapped = -1;
+}
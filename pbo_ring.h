@@ -0,0 +1,40 @@
+﻿#ifndef RAYTRACINGWEEKEND_PBO_RING_H
+#define RAYTRACINGWEEKEND_PBO_RING_H
+
+#include <cstddef>
+#include <vector>
+
+#include "include/glad/glad.h"
+#include "render_pass.h"
+
+/// Streams texture uploads through a ring of pixel buffer objects, so the UI thread never waits for the driver.
+///
+/// Each frame maps the next buffer (unsynchronized, its fence says the GPU is done with it), the caller writes the
+/// pixels straight into it, and upload() hands it to glTexSubImage2D, which copies asynchronously. If the GPU is still
+/// reading every buffer the frame is skipped instead of stalling.
+/// Like the viewport texture, the buffers are left to the GL context, there's no context anymore when the viewport
+/// goes away.
+class pbo_ring
+{
+public:
+	static constexpr int ring_size = 3;
+
+	/// Maps the next buffer for writing `bytes`. Only call with a current GL context
+	///
+	/// Returns: nullptr if every buffer is still in use by the GPU, try again next frame
+	void* map(size_t bytes);
+
+	/// Unmaps the buffer from map() and starts copying it into `texture`. The buffer holds the pixels of `rects`, one
+	/// after the other, each row by row
+	void upload(GLuint texture, const std::vector<image_tile>& rects, GLenum format, GLenum type,
+	            size_t bytes_per_pixel);
+
+private:
+	GLuint buffers[ring_size] = {};
+	GLsync fences[ring_size] = {};
+	size_t sizes[ring_size] = {};
+	int next = 0;
+	int mapped = -1;
+};
+
+#endif //RAYTRACINGWEEKEND_PBO_RING_H
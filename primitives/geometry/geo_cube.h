@@ -68,7 +68,7 @@ public:
 		if (modified)
 		{
 			// perhaps, this is hell.
-			_viewport.mark_scene_dirty();
+			_viewport.mark_object_changed(*this);
 
 			auto min = point3(std::fmin(a.x(), b.x()), std::fmin(a.y(), b.y()), std::fmin(a.z(), b.z()));
 			auto max = point3(std::fmax(a.x(), b.x()), std::fmax(a.y(), b.y()), std::fmax(a.z(), b.z()));
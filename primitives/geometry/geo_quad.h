@@ -1,6 +1,7 @@
 ﻿#ifndef RAYTRACINGWEEKEND_QUAD_H
 #define RAYTRACINGWEEKEND_QUAD_H
 #include "../../hittable.h"
+#include "../../render_stats.h"
 #include "../../ui_components.h"
 
 class geo_quad : public hittable
@@ -36,6 +37,8 @@ public:
 
 	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
 	{
+		stat_add(render_stats::local().primitive_tests);
+
 		auto denom = dot(normal, r.direction());
 
 		if (std::fabs(denom) < 1e-8) // basically parallel to plane
@@ -99,7 +102,7 @@ public:
 
 			set_bounding_box();
 
-			_viewport.mark_scene_dirty();
+			_viewport.mark_object_changed(*this);
 		}
 		return modified;
 	}
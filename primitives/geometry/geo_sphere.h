@@ -2,6 +2,7 @@
 #define RAYTRACINGWEEKEND_SPHERE_H
 
 #include "../../hittable.h"
+#include "../../render_stats.h"
 #include "../../imgui/imgui.h"
 #include "../../ui_components.h"
 
@@ -38,6 +39,8 @@ public:
 
 	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
 	{
+		stat_add(render_stats::local().primitive_tests);
+
 		// point3 center_current = center.at(r.time());
 		point3 center_current = center;
 		vec3 oc = center_current - r.origin();
@@ -98,7 +101,7 @@ public:
 
 		if (changed)
 		{
-			_viewport.mark_scene_dirty();
+			_viewport.mark_object_changed(*this);
 			// Recalc bbox
 			auto rvec = vec3::one * radius;
 			bbox = aabb(center - rvec, center + rvec);
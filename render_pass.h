@@ -0,0 +1,99 @@
+﻿#ifndef RAYTRACINGWEEKEND_RENDER_PASS_H
+#define RAYTRACINGWEEKEND_RENDER_PASS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// A rectangle of the image, in pixels from the top left
+struct image_tile
+{
+	int x = 0;
+	int y = 0;
+	int width = 0;
+	int height = 0;
+
+	[[nodiscard]] int pixel_count() const
+	{
+		return width * height;
+	}
+};
+
+/// A tile to render, handed out by the tile_scheduler
+struct tile_job
+{
+	image_tile tile;
+	uint64_t generation = 0; // scheduler generation the job belongs to, stale jobs are dropped
+	int round = 0;           // how many times this tile was handed out before (in this generation)
+	int samples = 1;         // samples to take per pixel
+};
+
+/// What a render polls between samples to find out its job is no longer wanted
+struct cancel_token
+{
+	const std::atomic<uint64_t>& generation; // the scheduler's, moves on with every reset
+	const std::atomic<bool>& stop;           // the worker is shutting down
+
+	[[nodiscard]] bool is_cancelled(const tile_job& job) const
+	{
+		return stop.load(std::memory_order_relaxed) || generation.load(std::memory_order_relaxed) != job.generation;
+	}
+};
+
+/// Result of rendering one tile_job, handed over to the viewport by pointer.
+/// The buffers keep their capacity between tiles, so a slot that's reused doesn't allocate.
+struct render_pass
+{
+	tile_job job;
+	int sample_count = 0;     // samples taken per pixel
+	double render_ns = 0;     // time the worker spent on it, for viewport::get_sample_cost()
+	std::vector<float> color; // RGB per pixel of the tile, row by row
+	std::vector<float> cost;  // ns, BVH nodes, primitive tests per sample for each pixel. Empty unless camera::record_cost
+
+	std::atomic<bool> in_use{false}; // owned by the viewport until it's merged
+};
+
+/// The render_pass slots of one worker. Slots grow on demand up to max_slots and then stay allocated, so rendering
+/// doesn't allocate once warmed up. When every slot is waiting to be merged the worker has to wait (back-pressure).
+class pass_pool
+{
+public:
+	static constexpr int max_slots = 32;
+
+	/// Returns a free slot, marked in use. Only call from the worker that owns the pool
+	///
+	/// Returns: nullptr if every slot is still queued in the viewport
+	render_pass* acquire()
+	{
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			render_pass* slot = slots[(next + i) % slots.size()].get();
+			if (!slot->in_use.load(std::memory_order_acquire))
+			{
+				next = (next + i + 1) % slots.size();
+				slot->in_use.store(true, std::memory_order_relaxed);
+				return slot;
+			}
+		}
+
+		if (slots.size() >= max_slots)
+			return nullptr;
+
+		slots.push_back(std::make_unique<render_pass>());
+		slots.back()->in_use.store(true, std::memory_order_relaxed);
+		return slots.back().get();
+	}
+
+	/// Gives a slot back once its contents are merged, from any thread
+	static void release(render_pass* pass)
+	{
+		pass->in_use.store(false, std::memory_order_release);
+	}
+
+private:
+	std::vector<std::unique_ptr<render_pass>> slots;
+	size_t next = 0; // where to start looking, so slots are reused in order
+};
+
+#endif //RAYTRACINGWEEKEND_RENDER_PASS_H
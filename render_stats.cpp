@@ -0,0 +1,77 @@
+﻿#include "render_stats.h"
+
+#include <mutex>
+#include <vector>
+
+namespace
+{
+	std::mutex registry_mutex;
+	std::vector<ray_stats*> live_stats;
+	ray_stats_totals retired; // threads that already exited
+	ray_stats_totals baseline; // totals at the last reset
+
+	ray_stats_totals sum_all()
+	{
+		ray_stats_totals totals = retired;
+		for (const ray_stats* stats : live_stats)
+		{
+			totals += stats->load();
+		}
+		return totals;
+	}
+}
+
+render_stats::registration::registration()
+{
+	std::lock_guard lock(registry_mutex);
+	live_stats.push_back(&stats);
+}
+
+render_stats::registration::~registration()
+{
+	std::lock_guard lock(registry_mutex);
+	retired += stats.load();
+	std::erase(live_stats, &stats);
+}
+
+ray_stats_totals render_stats::collect()
+{
+	std::lock_guard lock(registry_mutex);
+	ray_stats_totals totals = sum_all();
+	totals -= baseline;
+	return totals;
+}
+
+void render_stats::reset()
+{
+	// Counters are owned by their threads, so remember where we are instead of writing zeroes into them
+	std::lock_guard lock(registry_mutex);
+	baseline = sum_all();
+}
+
+void ray_stats_totals::write_json(json_writer& json) const
+{
+	auto per_ray = [this](uint64_t count) { return rays > 0 ? static_cast<double>(count) / rays : 0.0; };
+
+	json.begin_object();
+	json.field("rays", rays);
+	json.field("bvh_nodes", bvh_nodes);
+	json.field("primitive_tests", primitive_tests);
+	json.field("hits", hits);
+	json.field("scatters", scatters);
+	json.field("bvh_nodes_per_ray", per_ray(bvh_nodes));
+	json.field("primitive_tests_per_ray", per_ray(primitive_tests));
+	json.field("hit_ratio", per_ray(hits));
+
+	// Trailing empty bins are left out
+	int last = ray_stats_depth_bins - 1;
+	while (last > 0 && depth[last] == 0)
+		last--;
+	json.key("bounce_depth");
+	json.begin_array();
+	for (int i = 0; i <= last; i++)
+		json.value(depth[i]);
+	json.end_array();
+
+	json.end_object();
+}
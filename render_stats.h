@@ -0,0 +1,115 @@
+﻿#ifndef RAYTRACINGWEEKEND_RENDER_STATS_H
+#define RAYTRACINGWEEKEND_RENDER_STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+#include "json_writer.h"
+
+/// Owner-thread-only increment. Compiles to a plain add.
+inline void stat_add(std::atomic<uint64_t>& counter, uint64_t amount = 1)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/// Number of bounce depth histogram bins. Paths longer than this end up in the last bin.
+constexpr int ray_stats_depth_bins = 32;
+
+/// Summed up counters, safe to copy around
+struct ray_stats_totals
+{
+	uint64_t rays = 0;            // rays traced against the world
+	uint64_t bvh_nodes = 0;       // BVH nodes visited (child boxes tested together)
+	uint64_t primitive_tests = 0; // sphere/quad intersection tests
+	uint64_t hits = 0;            // rays that hit something
+	uint64_t scatters = 0;        // material::scatter calls that produced a new ray
+	uint64_t depth[ray_stats_depth_bins] = {}; // finished paths by number of bounces
+
+	ray_stats_totals& operator +=(const ray_stats_totals& other)
+	{
+		rays += other.rays;
+		bvh_nodes += other.bvh_nodes;
+		primitive_tests += other.primitive_tests;
+		hits += other.hits;
+		scatters += other.scatters;
+		for (int i = 0; i < ray_stats_depth_bins; i++)
+			depth[i] += other.depth[i];
+		return *this;
+	}
+
+	ray_stats_totals& operator -=(const ray_stats_totals& other)
+	{
+		rays -= other.rays;
+		bvh_nodes -= other.bvh_nodes;
+		primitive_tests -= other.primitive_tests;
+		hits -= other.hits;
+		scatters -= other.scatters;
+		for (int i = 0; i < ray_stats_depth_bins; i++)
+			depth[i] -= other.depth[i];
+		return *this;
+	}
+
+	/// Writes the counters and a few ratios as a JSON object
+	void write_json(json_writer& json) const;
+};
+
+/// Counters of a single thread. Only the owning thread writes them, so no read-modify-write atomics are needed,
+/// the atomics are only there so other threads can read them while rendering.
+struct alignas(64) ray_stats
+{
+	std::atomic<uint64_t> rays{0};
+	std::atomic<uint64_t> bvh_nodes{0};
+	std::atomic<uint64_t> primitive_tests{0};
+	std::atomic<uint64_t> hits{0};
+	std::atomic<uint64_t> scatters{0};
+	std::atomic<uint64_t> depth[ray_stats_depth_bins] = {};
+
+	ray_stats_totals load() const
+	{
+		ray_stats_totals totals;
+		totals.rays = rays.load(std::memory_order_relaxed);
+		totals.bvh_nodes = bvh_nodes.load(std::memory_order_relaxed);
+		totals.primitive_tests = primitive_tests.load(std::memory_order_relaxed);
+		totals.hits = hits.load(std::memory_order_relaxed);
+		totals.scatters = scatters.load(std::memory_order_relaxed);
+		for (int i = 0; i < ray_stats_depth_bins; i++)
+			totals.depth[i] = depth[i].load(std::memory_order_relaxed);
+		return totals;
+	}
+
+	/// Records a finished path
+	void add_depth(int bounces)
+	{
+		stat_add(depth[std::clamp(bounces, 0, ray_stats_depth_bins - 1)]);
+	}
+};
+
+class render_stats
+{
+public:
+	/// The counters of the calling thread
+	static ray_stats& local()
+	{
+		thread_local registration reg;
+		return reg.stats;
+	}
+
+	/// Sum of every thread (alive or not) since the last reset
+	static ray_stats_totals collect();
+
+	/// Zeroes the totals reported by collect()
+	static void reset();
+
+private:
+	/// Registers the thread's counters on first use, folds them into the retired totals when the thread exits
+	struct registration
+	{
+		ray_stats stats;
+
+		registration();
+		~registration();
+	};
+};
+
+#endif //RAYTRACINGWEEKEND_RENDER_STATS_H
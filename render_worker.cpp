@@ -1,7 +1,9 @@
 ﻿#include "render_worker.h"
+#include "thread_affinity.h"
+#include "trace.h"
 #include "viewport.h"
 
-render_worker::render_worker(viewport& vp): _viewport(vp), early_exit(false), sigkill(false)
+render_worker::render_worker(viewport& vp, int index): _viewport(vp), index(index)
 {
 	thread = std::thread(&render_worker::render_loop, this);
 }
@@ -10,14 +12,14 @@ render_worker::~render_worker()
 {
 	std::clog<<"WORKER DECONSTRUCT" << '\n';
 
-	early_exit = true;
 	sigkill = true;
 	thread.join();
 }
 
-void render_worker::reset()
+void render_worker::wait_idle() const
 {
-	early_exit = true;
+	while (busy.load(std::memory_order_seq_cst))
+		std::this_thread::yield();
 }
 
 
@@ -29,28 +31,85 @@ bool render_worker::get_heartbeat() const
 
 void render_worker::render_loop()
 {
+	trace::set_thread_name("render_worker");
+	bool pinned = false;
+
 	while (!sigkill)
 	{
-		// std::clog << "thread " << this << ": sigkill: " << sigkill << " early_exit: " << early_exit << '\n';
+		// std::clog << "thread " << this << ": sigkill: " << sigkill << '\n';
 		heartbeat = true;
-		if (render(_viewport.target_scene.s_camera, _viewport.target_scene.get_render_scene()))
+
+		if (_viewport.get_pin_workers() != pinned)
+		{
+			pinned = !pinned;
+			const std::vector<int>& cpus = thread_affinity::allowed_cpus();
+			if (pinned)
+				thread_affinity::pin_current_thread(cpus[index % cpus.size()]);
+			else
+				thread_affinity::unpin_current_thread();
+		}
+
+		// BVH rebuild tasks first, nothing renders until the scene is rebuilt anyway
+		if (_viewport.build_tasks.run_one())
+			continue;
+
+		// Every slot still queued in the viewport means it's behind, wait for it instead of piling up more tiles
+		if (!output)
+			output = _viewport.get_pass_pool(index).acquire();
+		if (!output)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		// Busy before looking at the generation: either pause_workers() waits for us, or we see its new generation
+		busy.store(true, std::memory_order_seq_cst);
+		tile_job job;
+		if (!_viewport.scheduler.next(index, job))
+		{
+			// Sample limit reached or paused, wait for a reset
+			busy.store(false, std::memory_order_release);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		bool finished = false;
+		if (job.generation == _viewport.scheduler.get_generation_counter().load(std::memory_order_seq_cst))
+		{
+			trace_span span("render_worker::render");
+			finished = render(_viewport.target_scene.s_camera, _viewport.target_scene.get_render_scene(), job);
+		}
+		busy.store(false, std::memory_order_release);
+
+		if (finished)
 		{
 			// std::clog << "thread " << this << " render finished!\n";
-			_viewport.append_image(output);
+			// Backlog full: the viewport is behind, wait for it instead of dropping the tile
+			bool handed_over;
+			while (!(handed_over = _viewport.append_image(output)) && !sigkill)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			if (handed_over)
+				output = nullptr;
 		}
-		else if (early_exit)
+		else
 		{
-			// reset early exit
-			early_exit = false;
+			// Cancelled (stale jobs are dropped) or shutting down, give it back if it's still wanted
+			_viewport.scheduler.requeue(index, job);
+			trace::instant("early_exit");
 		}
 	}
+	if (output)
+		pass_pool::release(output);
 	heartbeat = false;
 	std::clog << "thread " << this << " quit successfully" << '\n';
 }
 
-bool render_worker::render(camera& _camera, const hittable& world)
+bool render_worker::render(camera& _camera, const hittable& world, const tile_job& job)
 {
-	// clear render buffer
-	output = std::vector<float>();
-	return _camera.render(world, output, early_exit, _viewport.density_map, _viewport.get_current_sample_count());
+	output->job = job;
+	cancel_token cancel{_viewport.scheduler.get_generation_counter(), sigkill};
+	auto start = std::chrono::steady_clock::now();
+	bool finished = _camera.render(world, job, *output, cancel, _viewport.density_map);
+	output->render_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	return finished;
 }
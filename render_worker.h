@@ -1,9 +1,11 @@
 ﻿#ifndef RAYTRACINGWEEKEND_RENDERER_H
 #define RAYTRACINGWEEKEND_RENDERER_H
+#include <atomic>
 #include <thread>
 
 #include "camera.h"
 #include "hittable_list.h"
+#include "render_pass.h"
 
 class viewport;
 
@@ -12,25 +14,29 @@ class render_worker
 public:
 	bool get_heartbeat() const;
 
-	explicit render_worker(viewport& vp);
+	/// `index`: Which tile_scheduler deque this worker takes tiles from
+	render_worker(viewport& vp, int index);
 
 	~render_worker();
 
-	void reset();
+	/// Blocks until the worker is done touching the scene, after the scheduler moved to a new generation.
+	/// Takes at most one sample of the job it's giving up
+	void wait_idle() const;
 
 	void render_loop();
 
-	bool render(camera& _camera, const hittable& world);
+	bool render(camera& _camera, const hittable& world, const tile_job& job);
 
 private:
 	viewport& _viewport;
-	bool early_exit = false;
-	bool sigkill = false;
-	std::vector<float> output;
+	int index;
+	std::atomic<bool> sigkill{false};
+	std::atomic<bool> busy{false}; // between taking a job and being done with the scene, see viewport::pause_workers()
+	render_pass* output = nullptr; // slot from the viewport's pass_pool, kept until a tile finishes in it
 
 	std::thread thread;
 
-	bool heartbeat = false;
+	std::atomic<bool> heartbeat{false};
 };
 
 
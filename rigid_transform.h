@@ -0,0 +1,98 @@
+﻿#ifndef RAYTRACINGWEEKEND_RIGID_TRANSFORM_H
+#define RAYTRACINGWEEKEND_RIGID_TRANSFORM_H
+
+#include "aabb.h"
+
+/// Rotation then translation, from an object's space to the space around it: p' = rotation * p + translation\n
+/// The rotation is orthonormal, so its inverse is its transpose and normals turn like directions
+class rigid_transform
+{
+public:
+	double rotation[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+	vec3 translation;
+
+	rigid_transform() = default;
+
+	static rigid_transform move(const vec3& offset)
+	{
+		rigid_transform t;
+		t.translation = offset;
+		return t;
+	}
+
+	/// Right hand rule, same as trn_rotate_x/y/z
+	static rigid_transform rotate(int axis, double sin_theta, double cos_theta)
+	{
+		rigid_transform t;
+		int a = (axis + 1) % 3;
+		int b = (axis + 2) % 3;
+		t.rotation[a][a] = cos_theta;
+		t.rotation[a][b] = -sin_theta;
+		t.rotation[b][a] = sin_theta;
+		t.rotation[b][b] = cos_theta;
+		return t;
+	}
+
+	/// `inner` first, then this
+	rigid_transform operator *(const rigid_transform& inner) const
+	{
+		rigid_transform t;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				t.rotation[i][j] = rotation[i][0] * inner.rotation[0][j] + rotation[i][1] * inner.rotation[1][j] +
+				                   rotation[i][2] * inner.rotation[2][j];
+		t.translation = apply(inner.translation);
+		return t;
+	}
+
+	[[nodiscard]] vec3 apply_direction(const vec3& v) const
+	{
+		return vec3(
+			rotation[0][0] * v.x() + rotation[0][1] * v.y() + rotation[0][2] * v.z(),
+			rotation[1][0] * v.x() + rotation[1][1] * v.y() + rotation[1][2] * v.z(),
+			rotation[2][0] * v.x() + rotation[2][1] * v.y() + rotation[2][2] * v.z()
+		);
+	}
+
+	[[nodiscard]] point3 apply(const point3& p) const
+	{
+		return apply_direction(p) + translation;
+	}
+
+	[[nodiscard]] vec3 inverse_direction(const vec3& v) const
+	{
+		return vec3(
+			rotation[0][0] * v.x() + rotation[1][0] * v.y() + rotation[2][0] * v.z(),
+			rotation[0][1] * v.x() + rotation[1][1] * v.y() + rotation[2][1] * v.z(),
+			rotation[0][2] * v.x() + rotation[1][2] * v.y() + rotation[2][2] * v.z()
+		);
+	}
+
+	[[nodiscard]] point3 inverse(const point3& p) const
+	{
+		return inverse_direction(p - translation);
+	}
+
+	/// Box around the 8 transformed corners of `box`
+	[[nodiscard]] aabb apply(const aabb& box) const
+	{
+		point3 min( infinity,  infinity,  infinity);
+		point3 max(-infinity, -infinity, -infinity);
+		for (int i = 0; i < 8; i++)
+		{
+			point3 corner = apply(point3(
+				i & 1 ? box.x.max : box.x.min,
+				i & 2 ? box.y.max : box.y.min,
+				i & 4 ? box.z.max : box.z.min
+			));
+			for (int c = 0; c < 3; c++)
+			{
+				min[c] = std::fmin(min[c], corner[c]);
+				max[c] = std::fmax(max[c], corner[c]);
+			}
+		}
+		return aabb(min, max);
+	}
+};
+
+#endif //RAYTRACINGWEEKEND_RIGID_TRANSFORM_H
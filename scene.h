@@ -5,7 +5,13 @@
 #include "bvh.h"
 #include "camera.h"
 #include "hittable_list.h"
+#include "task_pool.h"
 #include "texture.h"
+#include "trace.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
 
 
 class scene
@@ -18,27 +24,95 @@ public:
 	std::vector<shared_ptr<texture>> textures;
 	hittable_list world;
 
-	void update()
+	/// Rebuilds the BVH if the scene changed, before returning.
+	/// `pool`: The build runs in parallel on it, with the calling thread helping
+	void update(task_pool* pool = nullptr)
 	{
+		if (pending)
+		{
+			// A background build may still swap its tree in, let it finish first
+			while (!pending->done.load(std::memory_order_acquire))
+			{
+				if (!pool || !pool->run_one())
+					std::this_thread::yield();
+			}
+			take_pending();
+		}
+
+		refit_changed();
 		if (dirty)
 		{
 			// Regenerate BVH
-			bvh_cache = bvh_node(world);
+			trace_span span("scene::update BVH rebuild");
+			bvh_cache = bvh_node::build(bvh_node::prepare(world, bvh_method), pool);
 			dirty = false;
 		}
 
 	}
 
+	/// Rebuilds the BVH as tasks on `pool` if the scene changed, the calling thread doesn't wait for it. The old BVH
+	/// stays until the new one is swapped in by a later call. Edits during the build start another one.
+	///
+	/// Returns: True once the BVH is up to date
+	bool update_async(task_pool& pool)
+	{
+		if (pending)
+		{
+			if (!pending->done.load(std::memory_order_acquire))
+				return false;
+			take_pending();
+		}
+
+		refit_changed();
+		if (!dirty)
+			return true;
+
+		auto build = std::make_shared<pending_build>();
+		pool.push([build, input = bvh_node::prepare(world, bvh_method), &pool]() mutable
+		{
+			trace_span span("scene::update BVH rebuild");
+			build->result = bvh_node::build(std::move(input), &pool);
+			build->done.store(true, std::memory_order_release);
+		});
+		pending = std::move(build);
+		dirty = false;
+		return false;
+	}
+
 	bool mark_dirty()
 	{
-		auto prev_dirty = dirty;
+		auto prev_dirty = is_dirty();
 		dirty = true;
 		return prev_dirty;
 	}
 
+	/// Like mark_dirty(), when `object` only moved or changed its shape or material: the next update refits the BVH
+	/// around it instead of rebuilding it, if it can
+	bool mark_changed(const hittable& object)
+	{
+		auto prev_dirty = is_dirty();
+		if (dirty || pending)
+			dirty = true; // a rebuild is coming anyway, the one that's running may have the old box
+		else
+			changed.push_back(&object);
+		return prev_dirty;
+	}
+
+	/// Changed since the BVH in use was built, or a new one is still being built
 	[[nodiscard]] bool is_dirty() const
 	{
-		return dirty;
+		return dirty || pending || !changed.empty();
+	}
+
+	[[nodiscard]] bvh_build get_bvh_build() const
+	{
+		return bvh_method;
+	}
+
+	/// Takes effect on the next rebuild, mark_dirty() to force one
+	void set_bvh_build(bvh_build method)
+	{
+		bvh_method = method;
 	}
 
 	hittable& get_render_scene()
@@ -51,7 +125,41 @@ public:
 
 private:
 	bool dirty = true;
+	bvh_build bvh_method = Bvh_sah;
 	bvh_node bvh_cache;
+
+	/// A build running on a task_pool. Shared with its task, so dropping it doesn't have to wait
+	struct pending_build
+	{
+		std::atomic<bool> done{false};
+		bvh_node result;
+	};
+	std::shared_ptr<pending_build> pending;
+
+	std::vector<const hittable*> changed; // see mark_changed()
+
+	/// Refits the BVH around the changed objects, or marks it for a rebuild if that doesn't work out
+	void refit_changed()
+	{
+		if (changed.empty())
+			return;
+
+		if (!dirty)
+		{
+			trace_span span("scene::update BVH refit");
+			if (!bvh_cache.refit(changed))
+				dirty = true;
+		}
+		changed.clear();
+	}
+
+	/// Uses the finished background build, unless the scene changed again since it started
+	void take_pending()
+	{
+		if (!dirty)
+			bvh_cache = std::move(pending->result);
+		pending.reset();
+	}
 };
 
 
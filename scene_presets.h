@@ -26,6 +26,42 @@ enum scene_preset
 	Dark
 };
 
+[[nodiscard]] inline std::string scene_preset_get_name(scene_preset preset)
+{
+	switch (preset)
+	{
+	case Empty:
+		return "empty";
+	case Sky:
+		return "sky";
+	case Cornell:
+		return "cornell";
+	case Chrome:
+		return "chrome";
+	case Spheres:
+		return "spheres";
+	case Dark:
+		return "dark";
+	}
+	return "unknown";
+}
+
+/// Looks up a preset by its name (see scene_preset_get_name), for the command line tools
+///
+/// Returns: False if no preset has that name
+inline bool scene_preset_from_name(const std::string& name, scene_preset& preset)
+{
+	for (scene_preset candidate : {Empty, Sky, Cornell, Chrome, Spheres, Dark})
+	{
+		if (scene_preset_get_name(candidate) == name)
+		{
+			preset = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
 class preset_scene_creator
 {
 public:
@@ -35,7 +71,9 @@ public:
 	{
 		_viewport.mark_scene_dirty(); // Stop all workers
 
+		bvh_build bvh = _viewport.get_bvh_build(); // a render setting, it stays
 		_viewport.target_scene = create_scene(_preset);
+		_viewport.target_scene.set_bvh_build(bvh);
 
 		_viewport.init_new_camera();
 		_viewport.target_scene.mark_dirty(); // Restart workers in next frame
@@ -0,0 +1,43 @@
+﻿#include "task_pool.h"
+
+#include <thread>
+
+void task_pool::push(std::function<void()> task)
+{
+	std::lock_guard lock(mutex);
+	tasks.push_back(std::move(task));
+}
+
+bool task_pool::run_one()
+{
+	std::function<void()> task;
+	{
+		std::lock_guard lock(mutex);
+		if (tasks.empty())
+			return false;
+		task = std::move(tasks.back());
+		tasks.pop_back();
+	}
+	task();
+	return true;
+}
+
+void task_group::run(std::function<void()> task)
+{
+	pending.fetch_add(1, std::memory_order_relaxed);
+	pool.push([this, task = std::move(task)]
+	{
+		task();
+		pending.fetch_sub(1, std::memory_order_release); // the group may be gone right after this
+	});
+}
+
+void task_group::wait()
+{
+	while (pending.load(std::memory_order_acquire) > 0)
+	{
+		// Others hold our remaining tasks, help out with anything until they're done
+		if (!pool.run_one())
+			std::this_thread::yield();
+	}
+}
@@ -0,0 +1,52 @@
+﻿#ifndef RAYTRACINGWEEKEND_TASK_POOL_H
+#define RAYTRACINGWEEKEND_TASK_POOL_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+/// Queue of small jobs that run on whatever threads have time for them: the render workers take them before tiles,
+/// and a thread waiting on a task_group runs them instead of blocking. Threads are never started for it.
+class task_pool
+{
+public:
+	task_pool() = default;
+
+	task_pool(const task_pool&) = delete;
+	task_pool& operator=(const task_pool&) = delete;
+
+	/// Any thread
+	void push(std::function<void()> task);
+
+	/// Any thread. Runs the newest queued task, newest first keeps a recursive job depth first.
+	///
+	/// Returns: False if there was nothing to run
+	bool run_one();
+
+private:
+	std::mutex mutex;
+	std::deque<std::function<void()>> tasks;
+};
+
+/// Tasks on a task_pool that are waited for together (fork-join)
+class task_group
+{
+public:
+	explicit task_group(task_pool& pool) : pool(pool) {}
+
+	task_group(const task_group&) = delete;
+	task_group& operator=(const task_group&) = delete;
+
+	/// Queues `task` on the pool
+	void run(std::function<void()> task);
+
+	/// Runs queued tasks, of this group or any other, until every task of this group is done
+	void wait();
+
+private:
+	task_pool& pool;
+	std::atomic<int> pending{0};
+};
+
+#endif //RAYTRACINGWEEKEND_TASK_POOL_H
@@ -0,0 +1,259 @@
+﻿#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../image_writer.h"
+#include "../json_writer.h"
+#include "../scene.h"
+#include "../scene_presets.h"
+#include "../viewport.h"
+
+// Golden image regression test: renders a preset with a fixed seed and sample count, compares it against the stored
+// reference in tests/golden, and records how long the render took.
+//
+// After an intentional change to the output (e.g. a new sampling pattern), regenerate the references with --update.
+
+#ifndef RAYTRACK_GOLDEN_DIR
+#define RAYTRACK_GOLDEN_DIR "tests/golden"
+#endif
+
+using test_clock = std::chrono::steady_clock;
+
+struct golden_image
+{
+	int width = 0;
+	int height = 0;
+	std::vector<float> rgb;
+};
+
+/// Reads a little endian .pfm written by write_pfm()
+static bool read_pfm(const std::string& filename, golden_image& image)
+{
+	std::ifstream in(filename, std::ios::binary);
+	if (!in)
+		return false;
+
+	std::string magic;
+	double scale;
+	in >> magic >> image.width >> image.height >> scale;
+	in.get(); // single whitespace before the data
+	if (magic != "PF" || scale >= 0 || image.width <= 0 || image.height <= 0)
+		return false;
+
+	image.rgb.resize(static_cast<size_t>(image.width) * image.height * 3);
+	for (int j = image.height - 1; j >= 0; j--) // bottom to top
+	{
+		in.read(reinterpret_cast<char*>(image.rgb.data() + static_cast<size_t>(j) * image.width * 3),
+		        static_cast<std::streamsize>(image.width * 3 * sizeof(float)));
+	}
+	return static_cast<bool>(in);
+}
+
+/// Renders like the app does (viewport + workers). Pixels are seeded individually, so the worker count doesn't matter
+static golden_image render(scene_preset preset, int width, int samples, uint64_t seed, int threads, double& seconds)
+{
+	rand_seed(seed); // some presets are randomly generated too
+	scene scn = preset_scene_creator::create_scene(preset);
+
+	// keep the preset's aspect ratio
+	int height = std::max(1, width * scn.s_camera.image_height / scn.s_camera.image_width);
+	scn.s_camera.image_width = width;
+	scn.s_camera.image_height = height;
+
+	auto start = test_clock::now();
+	scn.update();
+
+	viewport vp(std::move(scn), width, height, 0, true);
+	vp.set_sample_count(1);
+	vp.set_sample_limit(samples);
+	vp.set_seed(seed);
+	vp.update(); // apply settings
+
+	vp.set_worker_count(threads);
+
+	while (vp.get_current_sample_count() < samples)
+	{
+		vp.update();
+		if (!vp.has_backlog())
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	vp.set_worker_count(0, true);
+	while (vp.has_backlog())
+		vp.update();
+
+	seconds = std::chrono::duration<double>(test_clock::now() - start).count();
+	return {width, height, vp.get_image()};
+}
+
+/// RMSE over display values (gamma corrected, clamped to [0, 1]) so a few HDR fireflies don't dominate
+static double display_rmse(const golden_image& a, const golden_image& b)
+{
+	double sum = 0;
+	for (size_t i = 0; i < a.rgb.size(); i++)
+	{
+		double diff = to_sdr(a.rgb[i]) - to_sdr(b.rgb[i]);
+		sum += diff * diff;
+	}
+	return std::sqrt(sum / a.rgb.size());
+}
+
+static void print_usage()
+{
+	std::cout << "Usage: raytrack_golden_test --scene <name> [options]\n"
+		<< "  --update          Overwrite the reference image instead of comparing\n"
+		<< "  --width <px>      Render width, height follows the preset's aspect ratio (default: 64)\n"
+		<< "  --samples <n>     Samples per pixel (default: 32)\n"
+		<< "  --seed <n>        Random seed (default: 1)\n"
+		<< "  --threads <n>     Render threads, the result must not depend on it (default: 1)\n"
+		<< "  --min-psnr <dB>   Fail below this PSNR against the reference (default: 50)\n"
+		<< "  --golden-dir <d>  Reference image folder (default: " RAYTRACK_GOLDEN_DIR ")\n"
+		<< "  --report <file>   Write PSNR/RMSE and time-to-image as JSON\n";
+}
+
+int main(int argc, char* argv[])
+{
+	bool has_preset = false;
+	scene_preset preset = Empty;
+	bool update = false;
+	int width = 64;
+	int samples = 32;
+	uint64_t seed = 1;
+	int threads = 1;
+	// The references match exactly on any thread count and BVH width. A few diverging pixels already fall below this,
+	// while float noise spread over the whole image stays above it
+	double min_psnr = 50;
+	std::string golden_dir = RAYTRACK_GOLDEN_DIR;
+	std::string report;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+		{
+			print_usage();
+			return EXIT_SUCCESS;
+		}
+		if (arg == "--update")
+		{
+			update = true;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << '\n';
+			return EXIT_FAILURE;
+		}
+		std::string value = argv[++i];
+
+		try
+		{
+			if (arg == "--scene")
+			{
+				has_preset = scene_preset_from_name(value, preset);
+				if (!has_preset)
+				{
+					std::cerr << "Unknown scene: " << value << '\n';
+					return EXIT_FAILURE;
+				}
+			}
+			else if (arg == "--width") width = std::max(1, std::stoi(value));
+			else if (arg == "--samples") samples = std::max(1, std::stoi(value));
+			else if (arg == "--seed") seed = std::stoull(value);
+			else if (arg == "--threads") threads = std::max(1, std::stoi(value));
+			else if (arg == "--min-psnr") min_psnr = std::stod(value);
+			else if (arg == "--golden-dir") golden_dir = value;
+			else if (arg == "--report") report = value;
+			else
+			{
+				std::cerr << "Unknown option: " << arg << '\n';
+				print_usage();
+				return EXIT_FAILURE;
+			}
+		}
+		catch (const std::exception&)
+		{
+			std::cerr << "Invalid value for " << arg << ": " << value << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!has_preset)
+	{
+		print_usage();
+		return EXIT_FAILURE;
+	}
+
+	std::string name = scene_preset_get_name(preset);
+	std::string golden_path = golden_dir + "/" + name + ".pfm";
+
+	double seconds = 0;
+	golden_image image = render(preset, width, samples, seed, threads, seconds);
+	std::cout << name << ": rendered " << image.width << " x " << image.height << " at " << samples
+		<< " spp on " << threads << " threads in " << seconds * 1000 << " ms\n";
+
+	if (update)
+	{
+		std::filesystem::create_directories(golden_dir);
+		if (!write_pfm(golden_path, image.rgb, image.width, image.height))
+		{
+			std::cerr << "Failed to write " << golden_path << '\n';
+			return EXIT_FAILURE;
+		}
+		std::cout << "Updated " << golden_path << '\n';
+		return EXIT_SUCCESS;
+	}
+
+	golden_image reference;
+	if (!read_pfm(golden_path, reference))
+	{
+		std::cerr << "Failed to read reference " << golden_path << " (run with --update to create it)\n";
+		return EXIT_FAILURE;
+	}
+	if (reference.width != image.width || reference.height != image.height)
+	{
+		std::cerr << "Reference is " << reference.width << " x " << reference.height << ", render is "
+			<< image.width << " x " << image.height << '\n';
+		return EXIT_FAILURE;
+	}
+
+	double rmse = display_rmse(image, reference);
+	double psnr = rmse > 0 ? 20 * std::log10(1.0 / rmse) : infinity;
+	bool passed = psnr >= min_psnr;
+
+	std::cout << name << ": RMSE " << rmse << ", PSNR " << psnr << " dB (min " << min_psnr << " dB) "
+		<< (passed ? "PASSED" : "FAILED") << '\n';
+
+	if (!report.empty())
+	{
+		std::ofstream file(report);
+		json_writer json(file);
+		json.begin_object();
+		json.field("scene", name);
+		json.field("width", image.width);
+		json.field("height", image.height);
+		json.field("samples", samples);
+		json.field("seed", static_cast<uint64_t>(seed));
+		json.field("threads", threads);
+		json.field("time_to_image_ms", seconds * 1000);
+		json.field("rmse", rmse);
+		json.field("psnr_db", psnr);
+		json.field("min_psnr_db", min_psnr);
+		json.field("passed", passed);
+		json.end_object();
+	}
+
+	if (!passed)
+	{
+		// Keep the failed render next to the report for inspection
+		write_pfm(name + "_failed.pfm", image.rgb, image.width, image.height);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
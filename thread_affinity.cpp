@@ -0,0 +1,124 @@
+﻿#include "thread_affinity.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+#ifdef __linux__
+	bool set_affinity(const std::vector<int>& cpus)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : cpus)
+		{
+			if (cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &set);
+		}
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+	}
+
+	/// CPUs worth of quota, 0 if unlimited or unknown
+	double cgroup_cpu_quota()
+	{
+		// cgroup v2: "<quota> <period>" or "max <period>"
+		std::ifstream v2("/sys/fs/cgroup/cpu.max");
+		std::string quota;
+		double period = 0;
+		if (v2 >> quota >> period)
+		{
+			if (quota == "max" || period <= 0)
+				return 0;
+			return std::stod(quota) / period;
+		}
+
+		// cgroup v1, quota is -1 if unlimited
+		std::ifstream v1_quota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+		std::ifstream v1_period("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+		double quota_us = 0;
+		if (v1_quota >> quota_us && v1_period >> period && quota_us > 0 && period > 0)
+			return quota_us / period;
+		return 0;
+	}
+#endif
+}
+
+const std::vector<int>& thread_affinity::allowed_cpus()
+{
+	static const std::vector<int> cpus = []
+	{
+		std::vector<int> result;
+#ifdef __linux__
+		// The process' mask, not the calling thread's, that one may be pinned already
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(getpid(), sizeof(set), &set) == 0)
+		{
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			{
+				if (CPU_ISSET(cpu, &set))
+					result.push_back(cpu);
+			}
+		}
+#endif
+		if (result.empty())
+		{
+			for (int cpu = 0; cpu < static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u)); cpu++)
+				result.push_back(cpu);
+		}
+		return result;
+	}();
+	return cpus;
+}
+
+int thread_affinity::usable_cpu_count()
+{
+	static const int count = []
+	{
+		int cpus = static_cast<int>(allowed_cpus().size());
+#ifdef __linux__
+		double quota = cgroup_cpu_quota();
+		if (quota > 0)
+			cpus = std::min(cpus, static_cast<int>(std::ceil(quota)));
+#endif
+		return std::max(cpus, 1);
+	}();
+	return count;
+}
+
+bool thread_affinity::is_supported()
+{
+#ifdef __linux__
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool thread_affinity::pin_current_thread(int cpu)
+{
+#ifdef __linux__
+	return set_affinity({cpu});
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+bool thread_affinity::unpin_current_thread()
+{
+#ifdef __linux__
+	return set_affinity(allowed_cpus());
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,29 @@
+﻿#ifndef RAYTRACINGWEEKEND_THREAD_AFFINITY_H
+#define RAYTRACINGWEEKEND_THREAD_AFFINITY_H
+
+#include <vector>
+
+/// Pinning threads to CPUs. Only does something on Linux, elsewhere everything reports "not supported".
+///
+/// Pinned workers also keep their memory local on multi-socket machines: Linux places a page on the NUMA node of the
+/// thread that touches it first, and each worker is the first to touch its own render_pass slots.
+class thread_affinity
+{
+public:
+	/// CPUs the process may run on (its affinity mask or cgroup cpuset), in ascending order
+	[[nodiscard]] static const std::vector<int>& allowed_cpus();
+
+	/// How many CPUs worth of time the process can actually get: allowed_cpus(), capped by a cgroup CPU quota
+	/// (containers) when there is one
+	[[nodiscard]] static int usable_cpu_count();
+
+	[[nodiscard]] static bool is_supported();
+
+	/// Restricts the calling thread to `cpu`
+	static bool pin_current_thread(int cpu);
+
+	/// Lets the calling thread run on any of allowed_cpus() again
+	static bool unpin_current_thread();
+};
+
+#endif //RAYTRACINGWEEKEND_THREAD_AFFINITY_H
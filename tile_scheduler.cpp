@@ -0,0 +1,224 @@
+﻿#include "tile_scheduler.h"
+
+#include <algorithm>
+
+tile_scheduler::tile_scheduler() : queues(max_queues)
+{
+}
+
+void tile_scheduler::reset(int image_width, int image_height, int tile_size, int sample_limit)
+{
+	std::lock_guard lock(round_mutex);
+	clear_queues();
+
+	tile_size = std::max(tile_size, 1);
+	tiles.clear();
+	for (int y = 0; y < image_height; y += tile_size)
+	{
+		for (int x = 0; x < image_width; x += tile_size)
+		{
+			tiles.push_back({x, y, std::min(tile_size, image_width - x), std::min(tile_size, image_height - y)});
+		}
+	}
+	this->tile_size = tile_size;
+	tile_columns = (image_width + tile_size - 1) / tile_size;
+
+	tile_rounds.assign(tiles.size(), 0);
+	tile_samples.assign(tiles.size(), 0);
+	this->sample_limit = sample_limit;
+	paused = false;
+	update_focus_tiles();
+}
+
+void tile_scheduler::set_focus(const image_tile& region, int samples)
+{
+	std::lock_guard lock(round_mutex);
+	focus = region;
+	focus_samples = std::max(samples, 1);
+	update_focus_tiles();
+	if (focus_tiles.empty())
+		return;
+
+	// Give back what's queued outside the focus. Not its rounds though, a worker may be rendering a later job of the
+	// same tile, and reusing a round would repeat its random numbers
+	std::vector<bool> focused(tiles.size());
+	for (int t : focus_tiles)
+		focused[t] = true;
+
+	for (int i = 0; i < queue_count.load(std::memory_order_acquire); i++)
+	{
+		std::lock_guard queue_lock(queues[i].mutex);
+		std::erase_if(queues[i].jobs, [&](const tile_job& job)
+		{
+			int t = job.tile.y / tile_size * tile_columns + job.tile.x / tile_size;
+			if (focused[t])
+				return false;
+			tile_samples[t] -= job.samples;
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		});
+	}
+}
+
+void tile_scheduler::update_focus_tiles()
+{
+	focus_tiles.clear();
+	if (focus.width <= 0 || focus.height <= 0)
+		return;
+
+	for (int t = 0; t < static_cast<int>(tiles.size()); t++)
+	{
+		const image_tile& tile = tiles[t];
+		if (tile.x < focus.x + focus.width && focus.x < tile.x + tile.width &&
+			tile.y < focus.y + focus.height && focus.y < tile.y + tile.height)
+			focus_tiles.push_back(t);
+	}
+}
+
+void tile_scheduler::pause()
+{
+	std::lock_guard lock(round_mutex);
+	clear_queues();
+	paused = true;
+}
+
+void tile_scheduler::clear_queues()
+{
+	generation.fetch_add(1, std::memory_order_seq_cst); // see viewport::pause_workers()
+	for (tile_queue& queue : queues)
+	{
+		std::lock_guard queue_lock(queue.mutex);
+		queued.fetch_sub(static_cast<int>(queue.jobs.size()), std::memory_order_relaxed);
+		queue.jobs.clear();
+	}
+}
+
+void tile_scheduler::set_queue_count(int count)
+{
+	count = std::clamp(count, 1, max_queues);
+
+	std::lock_guard lock(round_mutex);
+	int old_count = queue_count.exchange(count, std::memory_order_acq_rel);
+
+	// Hand the leftovers of removed workers to the remaining ones
+	std::vector<tile_job> orphans;
+	for (int i = count; i < old_count; i++)
+	{
+		std::lock_guard queue_lock(queues[i].mutex);
+		orphans.insert(orphans.end(), queues[i].jobs.begin(), queues[i].jobs.end());
+		queues[i].jobs.clear();
+	}
+	for (size_t i = 0; i < orphans.size(); i++)
+	{
+		tile_queue& queue = queues[i % count];
+		std::lock_guard queue_lock(queue.mutex);
+		queue.jobs.push_back(orphans[i]);
+	}
+}
+
+bool tile_scheduler::next(int worker_index, tile_job& job)
+{
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		int count = queue_count.load(std::memory_order_acquire);
+		int own = worker_index % count;
+
+		if (pop_front(own, job))
+			return true;
+
+		for (int i = 1; i < count; i++)
+		{
+			if (pop_back((own + i) % count, job))
+				return true;
+		}
+
+		if (attempt == 0)
+		{
+			std::lock_guard lock(round_mutex);
+			deal_round();
+		}
+	}
+	return false;
+}
+
+void tile_scheduler::requeue(int worker_index, const tile_job& job)
+{
+	std::lock_guard lock(round_mutex); // no reset in between
+	if (job.generation != generation.load(std::memory_order_acquire))
+		return;
+
+	tile_queue& queue = queues[worker_index % queue_count.load(std::memory_order_acquire)];
+	std::lock_guard queue_lock(queue.mutex);
+	queue.jobs.push_front(job);
+	queued.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool tile_scheduler::pop_front(int queue, tile_job& job)
+{
+	tile_queue& q = queues[queue];
+	std::lock_guard lock(q.mutex);
+	if (q.jobs.empty())
+		return false;
+
+	job = q.jobs.front();
+	q.jobs.pop_front();
+	queued.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool tile_scheduler::pop_back(int queue, tile_job& job)
+{
+	tile_queue& q = queues[queue];
+	std::lock_guard lock(q.mutex);
+	if (q.jobs.empty())
+		return false;
+
+	job = q.jobs.back();
+	q.jobs.pop_back();
+	queued.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+void tile_scheduler::deal_round()
+{
+	// Someone else dealt already, or tiles are left to steal
+	if (queued.load(std::memory_order_relaxed) > 0 || paused)
+		return;
+	int samples = round_samples.load(std::memory_order_relaxed);
+	int count = queue_count.load(std::memory_order_acquire);
+
+	// Focus tiles first. Deal them repeatedly if there are fewer than workers, every job has its own round
+	int focus_target = sample_limit > 0 ? std::min(focus_samples, sample_limit) : focus_samples;
+	int dealt = 0;
+	while (dealt < count)
+	{
+		int before = dealt;
+		for (int t : focus_tiles)
+		{
+			if (tile_samples[t] < focus_target)
+				deal_tile(t, std::min(samples, focus_target - tile_samples[t]), dealt++ % count);
+		}
+		if (dealt == before)
+			break; // focus is done
+	}
+	if (dealt > 0)
+		return;
+
+	for (int t = 0; t < static_cast<int>(tiles.size()); t++)
+	{
+		int tile_sample_count = samples;
+		if (sample_limit > 0)
+			tile_sample_count = std::min(samples, sample_limit - tile_samples[t]); // land exactly on the limit
+		if (tile_sample_count > 0)
+			deal_tile(t, tile_sample_count, t % count);
+	}
+}
+
+void tile_scheduler::deal_tile(int t, int samples, int queue)
+{
+	tile_queue& q = queues[queue];
+	std::lock_guard lock(q.mutex);
+	q.jobs.push_back({tiles[t], generation.load(std::memory_order_acquire), tile_rounds[t]++, samples});
+	tile_samples[t] += samples;
+	queued.fetch_add(1, std::memory_order_relaxed);
+}
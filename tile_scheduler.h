@@ -0,0 +1,115 @@
+﻿#ifndef RAYTRACINGWEEKEND_TILE_SCHEDULER_H
+#define RAYTRACINGWEEKEND_TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "render_pass.h"
+
+/// Hands out tiles of the image to the render workers.
+///
+/// The image is rendered in rounds: each round covers every tile once. A round's tiles are dealt round-robin into one
+/// deque per worker. Workers take from the front of their own deque and steal from the back of the others' when it
+/// runs dry. The next round is dealt once every deque is empty.
+///
+/// With a focus region set, rounds only cover the tiles touching it until they have their focus samples, the rest of
+/// the image catches up after that.
+class tile_scheduler
+{
+public:
+	/// More workers than this share deques
+	static constexpr int max_queues = 256;
+
+	tile_scheduler();
+
+	/// Drops all queued tiles and starts over at round 0 with a new generation.
+	/// `sample_limit`: Stop handing out tiles once every tile got this many samples. 0 = unlimited
+	void reset(int image_width, int image_height, int tile_size, int sample_limit);
+
+	/// Samples per pixel for the jobs of rounds dealt from now on
+	void set_round_samples(int samples)
+	{
+		round_samples.store(std::max(samples, 1), std::memory_order_relaxed);
+	}
+
+	/// Tiles touching `region` (pixels) get priority until they have `samples` samples per pixel. An empty region turns
+	/// it off. Queued tiles outside the region are dropped, so the focus takes over right away. Kept across resets
+	void set_focus(const image_tile& region, int samples);
+
+	/// Drops all queued tiles and moves to a new generation, but hands out nothing until the next reset.
+	/// Running jobs see the new generation through their cancel_token and give up
+	void pause();
+
+	/// Number of workers taking tiles. Tiles queued for workers that went away are moved to the remaining ones
+	void set_queue_count(int count);
+
+	/// Takes the next tile for worker `worker_index`, own deque first, then steals.
+	///
+	/// Returns: False if there's nothing to do (sample limit reached)
+	bool next(int worker_index, tile_job& job);
+
+	/// Puts back a job that was cancelled before it finished, unless it's from an older generation
+	void requeue(int worker_index, const tile_job& job);
+
+	[[nodiscard]] uint64_t get_generation() const
+	{
+		return generation.load(std::memory_order_acquire);
+	}
+
+	/// For cancel_token, so renders can poll it without going through the scheduler
+	[[nodiscard]] const std::atomic<uint64_t>& get_generation_counter() const
+	{
+		return generation;
+	}
+
+	[[nodiscard]] int get_tile_count() const
+	{
+		return static_cast<int>(tiles.size());
+	}
+
+private:
+	struct alignas(64) tile_queue
+	{
+		std::mutex mutex;
+		std::deque<tile_job> jobs;
+	};
+
+	std::vector<tile_queue> queues; // always max_queues long, so workers never race a resize
+	std::atomic<int> queue_count{1};
+	std::atomic<int> queued{0};     // tiles in all deques
+
+	std::mutex round_mutex;         // dealing rounds, reset, set_queue_count
+	std::vector<image_tile> tiles;  // one round
+	std::atomic<uint64_t> generation{0};
+	std::vector<int> tile_rounds;   // per tile, jobs dealt so far. Also picks the job's random numbers
+	std::vector<int> tile_samples;  // per tile, samples dealt so far
+	int tile_size = 1;
+	int tile_columns = 0;
+	int sample_limit = 0;
+	std::atomic<int> round_samples{1};
+
+	image_tile focus;               // width 0 = no focus
+	int focus_samples = 0;
+	std::vector<int> focus_tiles;   // indices into tiles
+	bool paused = false;
+
+	bool pop_front(int queue, tile_job& job);
+	bool pop_back(int queue, tile_job& job);
+
+	/// Deals the next round if every deque is empty. Call with round_mutex held
+	void deal_round();
+
+	/// Queues the next job of tile `t`. Call with round_mutex held
+	void deal_tile(int t, int samples, int queue);
+
+	/// Rebuilds focus_tiles for the current grid. Call with round_mutex held
+	void update_focus_tiles();
+
+	/// New generation, empty deques. Call with round_mutex held
+	void clear_queues();
+};
+
+#endif //RAYTRACINGWEEKEND_TILE_SCHEDULER_H
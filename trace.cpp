@@ -0,0 +1,162 @@
+﻿#include "trace.h"
+
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "json_writer.h"
+
+std::atomic<bool> trace::enabled{false};
+
+namespace
+{
+	constexpr size_t max_events_per_thread = 1 << 20; // stop recording a thread instead of eating all memory
+
+	struct trace_event
+	{
+		const char* name;
+		char phase; // 'X' = complete, 'i' = instant
+		trace::clock::time_point begin;
+		trace::clock::duration duration;
+	};
+
+	/// Events of one thread. Kept alive by the registry after the thread exits, workers come and go all the time
+	struct thread_events
+	{
+		int tid;
+		std::string name;
+		std::mutex mutex; // only contended while writing the file
+		std::vector<trace_event> events;
+	};
+
+	std::mutex registry_mutex;
+	std::vector<std::shared_ptr<thread_events>> registry;
+	int next_tid = 1;
+	trace::clock::time_point trace_start;
+
+	thread_local std::string thread_name;
+
+	/// Registers the calling thread on its first event, so threads that never record anything cost nothing
+	thread_events& local_events()
+	{
+		thread_local std::shared_ptr<thread_events> events = []
+		{
+			auto created = std::make_shared<thread_events>();
+			created->name = thread_name;
+			std::lock_guard lock(registry_mutex);
+			created->tid = next_tid++;
+			registry.push_back(created);
+			return created;
+		}();
+		return *events;
+	}
+
+	void record(const trace_event& event)
+	{
+		thread_events& local = local_events();
+		std::lock_guard lock(local.mutex);
+		if (local.events.size() < max_events_per_thread)
+			local.events.push_back(event);
+	}
+
+	double to_us(trace::clock::duration d)
+	{
+		return std::chrono::duration<double, std::micro>(d).count();
+	}
+}
+
+void trace::start()
+{
+	{
+		std::lock_guard lock(registry_mutex);
+
+		// Forget threads that exited, clear the rest
+		std::erase_if(registry, [](const std::shared_ptr<thread_events>& events) { return events.use_count() == 1; });
+		for (auto& events : registry)
+		{
+			std::lock_guard events_lock(events->mutex);
+			events->events.clear();
+		}
+		trace_start = clock::now();
+	}
+	enabled.store(true, std::memory_order_relaxed);
+}
+
+void trace::stop()
+{
+	enabled.store(false, std::memory_order_relaxed);
+}
+
+bool trace::write(const std::string& filename)
+{
+	std::ofstream file(filename);
+	if (!file)
+		return false;
+	file << std::fixed << std::setprecision(3); // microsecond timestamps, keep the nanoseconds
+
+	json_writer json(file);
+	json.begin_object();
+	json.field("displayTimeUnit", "ms");
+	json.key("traceEvents");
+	json.begin_array();
+
+	std::lock_guard lock(registry_mutex);
+	for (auto& events : registry)
+	{
+		std::lock_guard events_lock(events->mutex);
+
+		if (!events->name.empty())
+		{
+			json.begin_object();
+			json.field("name", "thread_name");
+			json.field("ph", "M");
+			json.field("pid", 1);
+			json.field("tid", events->tid);
+			json.key("args");
+			json.begin_object();
+			json.field("name", events->name);
+			json.end_object();
+			json.end_object();
+		}
+
+		for (const trace_event& event : events->events)
+		{
+			json.begin_object();
+			json.field("name", event.name);
+			json.field("ph", std::string(1, event.phase));
+			json.field("pid", 1);
+			json.field("tid", events->tid);
+			json.field("ts", to_us(event.begin - trace_start));
+			if (event.phase == 'X')
+				json.field("dur", to_us(event.duration));
+			else
+				json.field("s", "t"); // instant event scoped to its thread
+			json.end_object();
+		}
+	}
+
+	json.end_array();
+	json.end_object();
+	return static_cast<bool>(file);
+}
+
+void trace::set_thread_name(const std::string& name)
+{
+	thread_name = name;
+}
+
+void trace::complete(const char* name, clock::time_point begin, clock::time_point end)
+{
+	if (!is_enabled())
+		return;
+	record({name, 'X', begin, end - begin});
+}
+
+void trace::instant(const char* name)
+{
+	if (!is_enabled())
+		return;
+	record({name, 'i', clock::now(), {}});
+}
@@ -0,0 +1,71 @@
+﻿#ifndef RAYTRACINGWEEKEND_TRACE_H
+#define RAYTRACINGWEEKEND_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/// Optional timeline recording, written as Chrome trace events (open in chrome://tracing or ui.perfetto.dev).
+/// When tracing is off a span costs one relaxed atomic load.
+class trace
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	/// Drops previously recorded events and starts recording
+	static void start();
+
+	/// Stops recording, recorded events are kept until the next start()
+	static void stop();
+
+	[[nodiscard]] static bool is_enabled()
+	{
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	/// Writes everything recorded since start() as trace event JSON
+	static bool write(const std::string& filename);
+
+	/// Name shown for the calling thread's row in the timeline. Call before the thread records anything
+	static void set_thread_name(const std::string& name);
+
+	/// Records a finished span. `name` must be a string literal (or outlive the trace)
+	static void complete(const char* name, clock::time_point begin, clock::time_point end);
+
+	/// Records a zero length marker
+	static void instant(const char* name);
+
+private:
+	static std::atomic<bool> enabled;
+};
+
+/// Records the time between construction and destruction as a span on the calling thread
+class trace_span
+{
+public:
+	explicit trace_span(const char* name) : name(name)
+	{
+		if (trace::is_enabled())
+		{
+			active = true;
+			begin = trace::clock::now();
+		}
+	}
+
+	~trace_span()
+	{
+		if (active)
+			trace::complete(name, begin, trace::clock::now());
+	}
+
+	trace_span(const trace_span&) = delete;
+	trace_span& operator=(const trace_span&) = delete;
+
+private:
+	const char* name;
+	bool active = false;
+	trace::clock::time_point begin;
+};
+
+#endif //RAYTRACINGWEEKEND_TRACE_H
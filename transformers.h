@@ -41,25 +41,29 @@ public:
 
 	aabb bounding_box() const override { return bbox; }
 
-	bool inspector_ui(viewport& _viewport, scene& _scene) override
+	bool get_placement(rigid_transform& transform, shared_ptr<hittable>& target) const override
 	{
-		bool modified = false;
-		if (hittable_slot("Target Object", object, *this, _scene))
-			modified = true;
+		transform = rigid_transform::move(offset);
+		target = object;
+		return true;
+	}
 
+	bool inspector_ui(viewport& _viewport, scene& _scene) override
+	{
+		bool retargeted = hittable_slot("Target Object", object, *this, _scene);
 		ImGui::SetItemTooltip("The object to translate. Please do not make circular references.");
 
-		if (ImGui::DragDouble3("Offset", offset.e))
-			modified = true;
+		bool moved = ImGui::DragDouble3("Offset", offset.e);
 		ImGui::SetItemTooltip("Move the object by this amount. It\'s highly recommended to rotate first, then move.");
 
-		if (modified)
-		{
+		if (retargeted)
 			_viewport.mark_scene_dirty();
+		else if (moved)
+			_viewport.mark_object_changed(*this);
+		if (retargeted || moved)
 			bbox = object->bounding_box() + offset;
-		}
 
-		return modified;
+		return retargeted || moved;
 	}
 private:
 	shared_ptr<hittable> object;
@@ -166,6 +170,13 @@ public:
 
 	aabb bounding_box() const override { return bbox; }
 
+	bool get_placement(rigid_transform& transform, shared_ptr<hittable>& target) const override
+	{
+		transform = rigid_transform::rotate(0, sin_theta, cos_theta);
+		target = object;
+		return true;
+	}
+
 	void internal_set_object(shared_ptr<hittable>& target)
 	{
 		object = target;
@@ -271,6 +282,13 @@ public:
 	}
 
 	aabb bounding_box() const override { return bbox; }
+
+	bool get_placement(rigid_transform& transform, shared_ptr<hittable>& target) const override
+	{
+		transform = rigid_transform::rotate(1, sin_theta, cos_theta);
+		target = object;
+		return true;
+	}
 private:
 	shared_ptr<hittable> object;
 	double angle;
@@ -372,6 +390,13 @@ public:
 	}
 
 	aabb bounding_box() const override { return bbox; }
+
+	bool get_placement(rigid_transform& transform, shared_ptr<hittable>& target) const override
+	{
+		transform = rigid_transform::rotate(2, sin_theta, cos_theta);
+		target = object;
+		return true;
+	}
 private:
 	shared_ptr<hittable> object;
 	double angle;
@@ -412,21 +437,29 @@ public:
 		return rot_z->bounding_box();
 	}
 
+	bool get_placement(rigid_transform& transform, shared_ptr<hittable>& target) const override
+	{
+		transform = rigid_transform();
+		target = rot_z;
+		return true;
+	}
+
 	bool inspector_ui(viewport& _viewport, scene& _scene) override
 	{
-		bool modified = false;
+		bool retargeted = false;
+		bool rotated = false;
 		ImGui::Text("Rotation will be offset if you rotate a translated object. It's recommended to rotate first, then translate.");
 
 		if (hittable_slot("Target object", original, *this, _scene))
 		{
-			modified = true;
+			retargeted = true;
 			rot_x->internal_set_object(original);
 		}
 		ImGui::SetItemTooltip("The object to rotate. Please do not make circular references.");
 
 		if (ImGui::DragDouble3("Angle", angle.e))
 		{
-			modified = true;
+			rotated = true;
 
 			// change angles!
 			rot_x->set_angle(angle.x());
@@ -435,8 +468,9 @@ public:
 		}
 		ImGui::SetItemTooltip("The rotate order is X, Y, then Z. Angles follow the right hand rule.");
 
-		if (modified) _viewport.mark_scene_dirty();
-		return modified;
+		if (retargeted) _viewport.mark_scene_dirty();
+		else if (rotated) _viewport.mark_object_changed(*this);
+		return retargeted || rotated;
 	}
 
 private:
@@ -4,6 +4,9 @@
 #include <misc/cpp/imgui_stdlib.h>
 #include "imgui.h"
 #include "imgui_internal.h"
+#include "render_stats.h"
+#include "thread_affinity.h"
+#include "trace.h"
 #include "scene_presets.h"
 #include "ui_components.h"
 #include "viewport.h"
@@ -36,6 +39,7 @@ public:
 				ImGui::MenuItem("Viewport", "", &show_viewport);
 				ImGui::Separator();
 				ImGui::MenuItem("Render Settings", "", &show_render);
+				ImGui::MenuItem("Statistics", "", &show_stats);
 				ImGui::MenuItem("Camera Settings", "", &show_camera);
 				ImGui::Separator();
 				ImGui::MenuItem("Scene", "", &show_scene);
@@ -104,6 +108,7 @@ public:
 		if (show_help) w_help(&show_help);
 		if (show_viewport) w_viewport(&show_viewport, _viewport);
 		if (show_render) w_renderSettings(&show_render, _viewport);
+		if (show_stats) w_statistics(&show_stats);
 		if (show_camera) w_cameraSettings(&show_camera, _viewport);
 		if (show_scene) w_scene(&show_scene, _viewport, _viewport.target_scene);
 		if (show_geometry) w_geometries(&show_geometry, _viewport, _viewport.target_scene);
@@ -116,6 +121,7 @@ private:
 	bool show_help		= true;
 	bool show_viewport	= true;
 	bool show_render	= true;
+	bool show_stats		= true;
 	bool show_camera	= true;
 	bool show_scene		= true;
 	bool show_geometry	= true;
@@ -268,6 +274,44 @@ private:
 			ImGui::TextColored(ImVec4(1,0,0,1), "(OUTDATED IMAGE! Waiting for new render!)");
 		}
 
+		ImGui::SetNextItemWidth(200);
+		if (ImGui::BeginCombo("Display", display_mode_get_human_name(_viewport.get_display_mode()).c_str()))
+		{
+			for (display_mode mode : {Display_color, Display_time, Display_bvh_nodes, Display_primitive_tests})
+			{
+				const bool is_selected = mode == _viewport.get_display_mode();
+				if (ImGui::Selectable(display_mode_get_human_name(mode).c_str(), is_selected))
+					_viewport.set_display_mode(mode);
+
+				if (is_selected)
+					ImGui::SetItemDefaultFocus();
+			}
+			ImGui::EndCombo();
+		}
+		ImGui::SetItemTooltip("Heatmaps show the average cost per sample of each pixel, blue = cheap, red = expensive. Cost is only recorded while a heatmap is shown.");
+		if (_viewport.get_display_mode() != Display_color)
+		{
+			ImGui::SameLine();
+			ImGui::Text("red = %.1f %s per sample", _viewport.get_heatmap_scale(),
+			            display_mode_get_unit(_viewport.get_display_mode()).c_str());
+		}
+
+		ImGui::SetNextItemWidth(200);
+		if (ImGui::BeginCombo("Focus", focus_mode_get_human_name(_viewport.get_focus_mode()).c_str()))
+		{
+			for (focus_mode mode : {Focus_off, Focus_mouse, Focus_rectangle, Focus_selection})
+			{
+				const bool is_selected = mode == _viewport.get_focus_mode();
+				if (ImGui::Selectable(focus_mode_get_human_name(mode).c_str(), is_selected))
+					_viewport.set_focus_mode(mode);
+
+				if (is_selected)
+					ImGui::SetItemDefaultFocus();
+			}
+			ImGui::EndCombo();
+		}
+		ImGui::SetItemTooltip("Renders part of the image first: the tiles around the mouse, a rectangle dragged over the image, or the object selected in the Scene Hierarchy. The rest of the image fills in once that part has its focus samples (Render Settings).");
+
 		// Auto resolution
 		if (_viewport.get_camera().auto_resolution)
 		{
@@ -288,10 +332,72 @@ private:
 		ImGui::SetCursorPosX((available_space.x - scaled_size.x) * 0.5f);
 
 		ImGui::Image(static_cast<ImTextureID>(static_cast<intptr_t>(_viewport.get_texture_id())), scaled_size);
+		update_focus(_viewport, ratio, scaled_size);
 
 		ImGui::End();
 	}
 
+	ImVec2 focus_drag_start;
+	/// Turns the focus mode into a region of the image, after the image was drawn with `ratio` screen px per pixel
+	void update_focus(viewport& _viewport, float ratio, ImVec2 scaled_size)
+	{
+		// Catch the mouse over the image, so dragging doesn't move the window
+		ImVec2 image_min = ImGui::GetItemRectMin();
+		ImGui::SetCursorScreenPos(image_min);
+		ImGui::InvisibleButton("##focus", ImVec2(std::max(scaled_size.x, 1.0f), std::max(scaled_size.y, 1.0f)));
+		auto to_pixel = [&](ImVec2 p) { return ImVec2((p.x - image_min.x) / ratio, (p.y - image_min.y) / ratio); };
+
+		switch (_viewport.get_focus_mode())
+		{
+		case Focus_mouse:
+			if (ImGui::IsItemHovered())
+			{
+				ImVec2 mouse = to_pixel(ImGui::GetMousePos());
+				int half = _viewport.get_tile_size();
+				_viewport.set_focus_region({static_cast<int>(mouse.x) - half, static_cast<int>(mouse.y) - half, half * 2, half * 2});
+			}
+			else
+			{
+				_viewport.set_focus_region({});
+			}
+			break;
+		case Focus_rectangle:
+			if (ImGui::IsItemActivated())
+				focus_drag_start = to_pixel(ImGui::GetMousePos());
+			if (ImGui::IsItemActive())
+			{
+				ImVec2 mouse = to_pixel(ImGui::GetMousePos());
+				int x0 = static_cast<int>(std::min(focus_drag_start.x, mouse.x));
+				int y0 = static_cast<int>(std::min(focus_drag_start.y, mouse.y));
+				int x1 = static_cast<int>(std::max(focus_drag_start.x, mouse.x)) + 1;
+				int y1 = static_cast<int>(std::max(focus_drag_start.y, mouse.y)) + 1;
+				_viewport.set_focus_region({x0, y0, x1 - x0, y1 - y0});
+			}
+			break;
+		case Focus_selection:
+		{
+			image_tile rect;
+			scene& _scene = _viewport.target_scene;
+			if (scene_selection >= 0 && scene_selection < _scene.world.objects.size() &&
+				_viewport.get_camera().project_box(_scene.world.objects[scene_selection]->bounding_box(), rect))
+				_viewport.set_focus_region(rect);
+			else
+				_viewport.set_focus_region({});
+			break;
+		}
+		default:
+			break;
+		}
+
+		const image_tile& region = _viewport.get_focus_region();
+		if (region.width > 0 && region.height > 0)
+		{
+			ImVec2 a(image_min.x + region.x * ratio, image_min.y + region.y * ratio);
+			ImVec2 b(a.x + region.width * ratio, a.y + region.height * ratio);
+			ImGui::GetWindowDrawList()->AddRect(a, b, IM_COL32(255, 255, 0, 200));
+		}
+	}
+
 	void w_renderSettings(bool* p_open, viewport& _viewport)
 	{
 		if (!ImGui::Begin("Render Settings", p_open, ImGuiWindowFlags_AlwaysAutoResize))
@@ -311,28 +417,63 @@ private:
 		if (ImGui::InputDouble("bias", &bi)) _viewport.set_bias(bi);
 		ImGui::SetItemTooltip("A small number. Fixes rendering issues. Do not touch this if you don't know what you're doing!");
 
+		int seed = static_cast<int>(_viewport.get_seed());
+		if (ImGui::InputInt("Seed", &seed)) _viewport.set_seed(static_cast<uint64_t>(std::max(seed, 0)));
+		ImGui::SetItemTooltip("Random seed of the render. The same seed always gives the same noise, no matter how many threads are used.");
+
+		bvh_build build = _viewport.get_bvh_build();
+		if (ImGui::BeginCombo("BVH build", bvh_build_get_human_name(build).c_str()))
+		{
+			for (bvh_build method : {Bvh_median, Bvh_sah})
+			{
+				const bool is_selected = method == build;
+				if (ImGui::Selectable(bvh_build_get_human_name(method).c_str(), is_selected))
+					_viewport.set_bvh_build(method);
+
+				if (is_selected)
+					ImGui::SetItemDefaultFocus();
+			}
+			ImGui::EndCombo();
+		}
+		ImGui::SetItemTooltip("How objects are grouped into the bounding volume hierarchy every ray walks through. The surface area heuristic picks splits that keep boxes small, so rays visit fewer nodes (see Statistics), especially when objects differ a lot in size. Median split is the simple original.");
+
 
 		ImGui::SeparatorText("Performance");
 
+		bool auto_workers = _viewport.get_auto_workers();
+		if (ImGui::Checkbox("Auto threads", &auto_workers)) _viewport.set_auto_workers(auto_workers);
+		ImGui::SetItemTooltip("Picks the number of render threads by itself: starts with one per core (leaving one for the interface) and keeps adjusting it to whatever renders the most samples per second.");
+
+		ImGui::BeginDisabled(auto_workers);
 		int tc = _viewport.get_workers_count();
 		if (ImGui::InputInt("Render threads", &tc, 1, 10)) _viewport.set_worker_count(tc);
 		ImGui::SetItemTooltip("For multithreaded rendering. How many worker threads to render your image at the same time. A reasonable number will make rendering faster by utilizing your entire system, but setting this too high will reduce performance.");
+		ImGui::EndDisabled();
+
+		if (thread_affinity::is_supported())
+		{
+			bool pin = _viewport.get_pin_workers();
+			if (ImGui::Checkbox("Pin threads to cores", &pin)) _viewport.set_pin_workers(pin);
+			ImGui::SetItemTooltip("Keeps each render thread on its own core instead of letting the OS move it around. Helps on machines with many cores or several CPU sockets, where a moved thread loses its caches and local memory.");
+		}
 
-		int sc = _viewport.get_sample_count();
-		if (ImGui::DragInt("Samples per worker", &sc, 1)) _viewport.set_sample_count(sc);
-		ImGui::SetItemTooltip("How many samples for each pixel should a worker take for each iteration. A low number (like 1) will make rendering more responsive, but a higher number will give you higher quality results faster.");
+		int tl = _viewport.get_target_latency();
+		if (ImGui::DragInt("Target latency (ms)", &tl, 1, 0, 1000)) _viewport.set_target_latency(tl);
+		ImGui::SetItemTooltip("How long a worker should spend on one tile. The number of samples per tile is picked from how expensive a sample turns out to be, so the image updates at a steady pace on any scene and resolution. 0 = off, use the fixed samples per tile below.");
 
-		int ms = _viewport.get_min_samples();
-		if (ImGui::DragInt("Target samples count", &ms, 1)) _viewport.set_min_samples(ms);
-		ImGui::SetItemTooltip("After rendering a while, workers will prefer rendering pixels with less than this amount of samples based on the fill probability.");
+		ImGui::BeginDisabled(tl > 0);
+		int sc = tl > 0 ? _viewport.get_round_samples() : _viewport.get_sample_count();
+		if (ImGui::DragInt("Samples per tile", &sc, 1)) _viewport.set_sample_count(sc);
+		ImGui::SetItemTooltip("How many samples for each pixel should a worker take for each tile. A low number (like 1) will make rendering more responsive, but a higher number will give you higher quality results faster.");
+		ImGui::EndDisabled();
 
-		double br = _viewport.get_basic_ratio();
-		if (ImGui::DragDouble("Render probability", &br, 0.1, 0.01, 1)) _viewport.set_basic_ratio(br);
-		ImGui::SetItemTooltip("Approximate ratio of pixels a worker will fill each iteration. A small ratio will make rendering more responsive, but slower.");
+		int fs = _viewport.get_focus_samples();
+		if (ImGui::DragInt("Focus samples", &fs, 1, 1, 1 << 20)) _viewport.set_focus_samples(fs);
+		ImGui::SetItemTooltip("With a focus set in the Viewport window, that part of the image gets this many samples per pixel before the rest continues.");
 
-		double fr = _viewport.get_fill_ratio();
-		if (ImGui::DragDouble("Fill probability", &fr, 0.1, 0.01, 1)) _viewport.set_fill_ratio(fr);
-		ImGui::SetItemTooltip("A special ratio to use for pixels with less samples than target after a while. Setting this relatively high will make workers actively fill holes in your render.");
+		int ts = _viewport.get_tile_size();
+		if (ImGui::DragInt("Tile size", &ts, 1, 4, 512)) _viewport.set_tile_size(ts);
+		ImGui::SetItemTooltip("The image is split into square tiles of this many pixels that workers render one at a time. Smaller tiles fill the image in more evenly, larger tiles have less overhead.");
 
 		int ds = _viewport.get_dark_samples();
 		if (ImGui::DragInt("Dark fill count", &ds)) _viewport.set_dark_samples(ds);
@@ -341,6 +482,106 @@ private:
 		ImGui::End();
 	}
 
+	ray_stats_totals stats_last;   // totals at the last rate update
+	ray_stats_totals stats_rate;   // counts during the last rate interval
+	double stats_last_time = 0;
+	double stats_interval = 1;
+	std::string trace_filename = "raytrack_trace.json";
+	bool trace_result = false; // a trace was saved (or not) since the window opened
+	bool trace_saved = false;
+	void w_statistics(bool* p_open)
+	{
+		if (!ImGui::Begin("Statistics", p_open, ImGuiWindowFlags_AlwaysAutoResize))
+		{
+			ImGui::End();
+			return;
+		}
+		ImGui::SetItemTooltip("Counters summed over all render threads since the last reset.");
+
+		ray_stats_totals totals = render_stats::collect();
+
+		// Refresh the per second numbers twice a second so they're readable
+		double now = ImGui::GetTime();
+		if (now - stats_last_time >= 0.5)
+		{
+			stats_rate = totals;
+			stats_rate -= stats_last;
+			stats_interval = now - stats_last_time;
+			stats_last = totals;
+			stats_last_time = now;
+		}
+
+		auto per_ray = [](uint64_t count, uint64_t rays) { return rays > 0 ? static_cast<double>(count) / rays : 0.0; };
+
+		ImGui::SeparatorText("Throughput");
+
+		ImGui::Text("Rays: %.2f M/s", stats_rate.rays / stats_interval / 1e6);
+		ImGui::Text("BVH nodes: %.2f M/s", stats_rate.bvh_nodes / stats_interval / 1e6);
+		ImGui::Text("Primitive tests: %.2f M/s", stats_rate.primitive_tests / stats_interval / 1e6);
+
+		ImGui::SeparatorText("Per ray");
+
+		ImGui::Text("BVH nodes visited: %.2f", per_ray(totals.bvh_nodes, totals.rays));
+		ImGui::SetItemTooltip("Average number of bounding boxes a ray is tested against. High numbers mean a poor BVH for this scene.");
+		ImGui::Text("Primitive tests: %.2f", per_ray(totals.primitive_tests, totals.rays));
+		ImGui::SetItemTooltip("Average number of sphere/quad intersection tests per ray.");
+		ImGui::Text("Hit ratio: %.1f%%", per_ray(totals.hits, totals.rays) * 100);
+
+		ImGui::SeparatorText("Totals");
+
+		ImGui::Text("Rays: %llu", static_cast<unsigned long long>(totals.rays));
+		ImGui::Text("Hits: %llu", static_cast<unsigned long long>(totals.hits));
+		ImGui::Text("Scatters: %llu", static_cast<unsigned long long>(totals.scatters));
+
+		ImGui::SeparatorText("Bounce depth");
+
+		float depth[ray_stats_depth_bins];
+		int last = 0;
+		for (int i = 0; i < ray_stats_depth_bins; i++)
+		{
+			depth[i] = static_cast<float>(totals.depth[i]);
+			if (totals.depth[i] > 0)
+				last = i;
+		}
+		ImGui::PlotHistogram("##depth", depth, last + 1, 0, nullptr, 0, FLT_MAX, ImVec2(240, 80));
+		ImGui::SetItemTooltip("Number of finished paths by bounce count (0 = missed everything). The last bar includes longer paths.");
+
+		if (ImGui::Button("Reset"))
+		{
+			render_stats::reset();
+			stats_last = ray_stats_totals();
+		}
+
+		ImGui::SeparatorText("Trace");
+
+		ImGui::InputText("File", &trace_filename);
+		ImGui::SetItemTooltip("Timeline of the render pipeline, open it in chrome://tracing or ui.perfetto.dev");
+		if (!trace::is_enabled())
+		{
+			if (ImGui::Button("Start recording"))
+				trace::start();
+		}
+		else
+		{
+			if (ImGui::Button("Stop and save"))
+			{
+				trace::stop();
+				trace_saved = trace::write(trace_filename);
+				trace_result = true;
+			}
+			ImGui::SameLine();
+			ImGui::TextColored(ImVec4(1,0,0,1), "Recording...");
+		}
+		if (trace_result && !trace::is_enabled())
+		{
+			ImGui::SameLine();
+			if (trace_saved) ImGui::Text("Saved");
+			else ImGui::TextColored(ImVec4(1,0,0,1), "Failed to save!");
+		}
+
+		ImGui::End();
+	}
+
 	void w_cameraSettings(bool* p_open, viewport& _viewport)
 	{
 		if (!ImGui::Begin("Camera Settings", p_open, ImGuiWindowFlags_AlwaysAutoResize))
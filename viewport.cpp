@@ -1,38 +1,43 @@
 ﻿#include "viewport.h"
 
-viewport::viewport(scene _scene, int resolution_width, int resolution_height, int workers_count): target_scene(std::move(_scene))
+#include "thread_affinity.h"
+#include "trace.h"
+
+viewport::viewport(scene _scene, int resolution_width, int resolution_height, int workers_count, bool headless):
+	target_scene(std::move(_scene)), headless(headless), pass_pools(tile_scheduler::max_queues),
+	// Merging is memory bound, a few helpers are plenty and leave the cores to the workers
+	merge_pool(std::clamp(thread_affinity::usable_cpu_count() / 4, 0, 3))
 {
 	// Set basic configs
 	max_bounces = 20;
 	bias = 0.001;
 	sample_count = 1;
-	min_samples = 30;
-	basic_ratio = 0.1;
-	fill_ratio = 0.7;
+	tile_size = 32;
 	dark_samples = 0; // EXPERIMENTAL. Disabled by default for now
 	init_new_camera();
 
 	// init gl texture
-	glGenTextures(1, &texture_id);
-	glBindTexture(GL_TEXTURE_2D, texture_id);
+	texture_id = 0;
+	if (!headless)
+	{
+		glGenTextures(1, &texture_id);
+		glBindTexture(GL_TEXTURE_2D, texture_id);
 
-	float border_color[] = { 0.0f, 0.0f, 0.0f, 1.0f};
-	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border_color);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		float border_color[] = { 0.0f, 0.0f, 0.0f, 1.0f};
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border_color);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
 
 
 	set_resolution(resolution_width, resolution_height);
 	reset();
 
 	// Generate workers. They will automatically get to work.
-	for (int i = 0; i < workers_count; i++)
-	{
-		workers.push_back(std::make_unique<render_worker>(*this));
-	}
+	set_worker_count(workers_count, true);
 
 	// todo: create texture!
 	std::clog << "constructor exit\n";
@@ -50,23 +55,26 @@ bool viewport::set_worker_count(int count, bool override)
 {
 	if (count < 1 && !override)
 		return false;
+	count = std::clamp(count, 0, tile_scheduler::max_queues); // one pass_pool per worker
+	auto target_count = static_cast<size_t>(count);
 
-	if (count > workers.size())
+	if (target_count > workers.size())
 	{
-		auto target = count - workers.size();
-		for (int i = 0; i < target; i++)
+		scheduler.set_queue_count(count);
+		while (workers.size() < target_count)
 		{
-			workers.push_back(std::make_unique<render_worker>(*this));
+			workers.push_back(std::make_unique<render_worker>(*this, static_cast<int>(workers.size())));
 		}
 		return true;
 	}
-	else if (count < workers.size())
+	else if (target_count < workers.size())
 	{
-		auto target = workers.size() - count;
-		for (int i = 0; i < target; i++)
+		auto target = workers.size() - target_count;
+		for (size_t i = 0; i < target; i++)
 		{
 			workers.pop_back();
 		}
+		scheduler.set_queue_count(count); // after the workers are gone, so their deques are really abandoned
 		return true;
 	}
 	else
@@ -78,30 +86,101 @@ bool viewport::set_worker_count(int count, bool override)
 
 bool viewport::mark_scene_dirty()
 {
-	if (target_scene.is_dirty())
-		return true;
-
-	temp_workers_count = get_workers_count();
-	set_worker_count(0, true);
+	// Still marked while a rebuild is running, so that rebuild isn't used
+	if (!target_scene.is_dirty())
+		pause_workers(); // otherwise already paused
 	return target_scene.mark_dirty();
 }
 
-void viewport::append_image(std::vector<float>& image)
+bool viewport::mark_object_changed(const hittable& object)
 {
-	if (dirty)
-		return;
+	if (!target_scene.is_dirty())
+		pause_workers();
+	return target_scene.mark_changed(object);
+}
 
-	if (backlog.size() > 100) // if resolution is too small, samples are submitted faster than update cycles, then memory grows too large
-		return;
+void viewport::pause_workers()
+{
+	trace_span span("viewport::pause_workers");
+
+	// The new generation cancels every running job. Workers are busy from before they look at the generation
+	// until they're done with the scene, so once none is busy nobody will touch the scene until the next reset.
+	scheduler.pause();
+	for (auto& worker : workers)
+	{
+		worker->wait_idle();
+	}
+}
+
+bool viewport::append_image(render_pass* pass)
+{
+	trace_span span("viewport::append_image");
+
+	if (dirty || pass->job.generation != scheduler.get_generation())
+	{
+		pass_pool::release(pass); // rendered for an older camera/resolution
+		return true;
+	}
 
-	if (image.size() != current_tex.size())
+	if (pass->color.size() != static_cast<size_t>(pass->job.tile.pixel_count() * channels_per_pixel))
 	{
 		std::clog<<":O";
-		return;
+		pass_pool::release(pass);
+		return true;
 	}
 
-	backlog.push(std::move(image));
-	current_samples += target_scene.s_camera.sample_count;
+	return backlog.try_push(pass);
+}
+
+std::vector<float> viewport::get_image() const
+{
+	std::vector<float> image(current_tex.size());
+
+	for (size_t i = 0; i < current_tex.size(); i++)
+	{
+		if (density_map[i] != 0)
+			image[i] = current_tex[i] / static_cast<float>(density_map[i]);
+	}
+
+	return image;
+}
+
+std::vector<float> viewport::get_heatmap(display_mode mode, float& scale) const
+{
+	int pixels = static_cast<int>(cost_density.size());
+	int channel = mode == Display_bvh_nodes ? 1 : mode == Display_primitive_tests ? 2 : 0;
+
+	std::vector<float> average(pixels, -1); // -1 = no cost recorded yet
+	std::vector<float> recorded;
+	recorded.reserve(pixels);
+	for (int px = 0; px < pixels; px++)
+	{
+		if (cost_density[px] == 0)
+			continue;
+		average[px] = cost_tex[px * 3 + channel] / static_cast<float>(cost_density[px]);
+		recorded.push_back(average[px]);
+	}
+
+	// Scale to the 99th percentile, so a handful of extreme pixels don't turn everything else blue
+	scale = 0;
+	if (!recorded.empty())
+	{
+		auto nth = recorded.begin() + (recorded.size() - 1) * 99 / 100;
+		std::nth_element(recorded.begin(), nth, recorded.end());
+		scale = *nth;
+	}
+
+	std::vector<float> image(static_cast<size_t>(pixels) * 3, 0.0f);
+	for (int px = 0; px < pixels; px++)
+	{
+		if (average[px] < 0)
+			continue; // black
+		color c = heatmap_color(scale > 0 ? average[px] / scale : 0);
+		image[px * 3] = static_cast<float>(c.x());
+		image[px * 3 + 1] = static_cast<float>(c.y());
+		image[px * 3 + 2] = static_cast<float>(c.z());
+	}
+	return image;
 }
 
 void viewport::update()
@@ -110,8 +189,12 @@ void viewport::update()
 	{
 		if (target_scene.is_dirty())
 		{
-			target_scene.update();
-			set_worker_count(temp_workers_count);
+			// Rebuilt by the paused workers, the window keeps showing the last image meanwhile. Without workers there's
+			// no one else to do it
+			if (get_workers_count() == 0)
+				target_scene.update(&build_tasks);
+			else if (!target_scene.update_async(build_tasks))
+				return;
 		}
 		// Stop everything! Reset renderers
 		// Don't clear the texture, prevent flickering
@@ -119,63 +202,98 @@ void viewport::update()
 		return;
 	}
 
+	// Take everything that's queued, tiles are small and the next frame would only find more.
+	// At most one ring's worth, so workers that keep pushing can't hold up the frame
+	int64_t samples_before = merged_samples;
+	double merged_ns = 0;
 	if (!backlog.empty())
 	{
-		// std::clog<<"backlog: " << backlog.size()<<"\n";
-
+		trace_span merge_span("viewport::update merge");
+		uint64_t generation = scheduler.get_generation();
+		int width = get_width();
 
-		// merge textures
-		auto &tex = backlog.front();
-
-		if (tex.size() == current_tex.size())
+		merging.clear();
+		render_pass* next;
+		for (size_t taken = 0; taken < backlog.capacity() && backlog.try_pop(next); taken++)
 		{
-			for (int i = 0; i < current_tex.size(); i++)
+			const image_tile& tile = next->job.tile;
+			if (next->job.generation != generation || tile.x + tile.width > width || tile.y + tile.height > get_height())
 			{
-				// Mix previous textures and new texture, normalization will be done later
-				// -1 means pixel is skipped, so no contribution
-				if (tex[i] >= 0)
-				{
-					current_tex[i] += tex[i];
-					density_map[i] += 1;
-				}
+				pass_pool::release(next);
+				continue; // skipped
 			}
+			merging.push_back(next);
+		}
 
-			// normalization; convert to sdr
-
-			std::vector<float> out_gamma(current_tex.size());
-
-			for (int i = 0; i < current_tex.size(); i++)
+		// Every thread takes a band of image rows and merges the part of each tile inside it, so no two threads touch
+		// the same pixel and each pixel still sees the tiles in order
+		merge_pool.parallel_for(get_height(), 16, [&](size_t band_begin, size_t band_end)
+		{
+			for (render_pass* pass : merging)
 			{
-				if (density_map[i] == 0 )
-					out_gamma[i] = 0.0f;
-				else
+				const image_tile& tile = pass->job.tile;
+				int row_begin = std::max(tile.y, static_cast<int>(band_begin));
+				int row_end = std::min(tile.y + tile.height, static_cast<int>(band_end));
+
+				auto samples = static_cast<float>(pass->sample_count);
+				bool with_cost = pass->cost.size() == pass->color.size(); // only there while a heatmap is shown
+				for (int y = row_begin; y < row_end; y++)
 				{
-					auto compensation = 1.0f / static_cast<float>(density_map[i]);
-					out_gamma[i] = linear_to_gamma(current_tex[i] * compensation);
+					size_t src = static_cast<size_t>(y - tile.y) * tile.width * channels_per_pixel;
+					size_t dst = (static_cast<size_t>(y) * width + tile.x) * channels_per_pixel;
+					int n = tile.width * channels_per_pixel;
+					float* tex = current_tex.data() + dst;
+					int* density = density_map.data() + dst;
+					const float* color = pass->color.data() + src;
+					for (int i = 0; i < n; i++)
+					{
+						// Mix previous textures and new texture weighted by samples, normalization will be done later
+						tex[i] += color[i] * samples;
+						density[i] += pass->sample_count;
+					}
+
+					if (with_cost)
+					{
+						for (int i = 0; i < tile.width * 3; i++)
+							cost_tex[dst + i] += pass->cost[src + i];
+						for (int i = 0; i < tile.width; i++)
+							cost_density[dst / 3 + i] += 1;
+					}
 				}
 			}
+		});
 
-			backlog.pop();
+		for (render_pass* pass : merging)
+		{
+			if (!headless)
+				dirty_rects.push_back(pass->job.tile);
+			merged_samples += static_cast<int64_t>(pass->job.tile.pixel_count()) * pass->sample_count;
+			merged_ns += pass->render_ns;
 			index++;
+			pass_pool::release(pass);
+		}
+		merging.clear();
 
+		current_samples = static_cast<int>(merged_samples / (static_cast<int64_t>(width) * get_height()));
+		display_dirty = true;
+	}
 
-			// update screen!
-
-			// OpenGL: sub texture
-			glBindTexture(GL_TEXTURE_2D, texture_id);
-			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
-			                get_width(), get_height(),
-			                GL_RGB, GL_FLOAT, out_gamma.data());
-		} else
-		{
-			std::clog<<":(";
-			if (!backlog.empty())
-				backlog.pop(); // skip
-			// backlog = std::queue<std::vector<float>>(); // clear backlog to fix weirdness
-		}
+	if (merged_samples > samples_before)
+	{
+		// Smoothed, a single tile of sky or of glass says little about the next one
+		double cost = merged_ns / static_cast<double>(merged_samples - samples_before);
+		sample_cost_ns = sample_cost_ns > 0 ? sample_cost_ns * 0.7 + cost * 0.3 : cost;
+		if (target_latency_ms > 0)
+			size_jobs_for_latency();
 	}
 
-	for (int i = 0; i < workers.size(); i++)
+	if (auto_workers)
+		tune_worker_count(merged_samples - samples_before);
+
+	if (display_dirty && !headless)
+		update_texture();
+
+	for (size_t i = 0; i < workers.size(); i++)
 	{
 		if (!workers[i]->get_heartbeat())
 		{
@@ -187,6 +305,121 @@ void viewport::update()
 	}
 }
 
+void viewport::tune_worker_count(int64_t new_samples)
+{
+	if (sample_limit > 0 && current_samples >= sample_limit)
+	{
+		tuner.restart_interval(); // done, idle workers say nothing about throughput
+		return;
+	}
+
+	double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	// With a UI, one core stays free for it, as when auto workers started
+	int count = tuner.update(new_samples, now, get_workers_count(), worker_tuner::max_count(!headless));
+	if (count != get_workers_count())
+	{
+		trace::instant("worker count tuned");
+		set_worker_count(count);
+	}
+}
+
+void viewport::size_jobs_for_latency()
+{
+	double tile_cost_ns = sample_cost_ns * tile_size * tile_size;
+	double samples = target_latency_ms * 1e6 / std::max(tile_cost_ns, 1.0);
+	round_samples = std::clamp(static_cast<int>(samples), 1, max_round_samples);
+	scheduler.set_round_samples(round_samples);
+}
+
+void viewport::set_auto_workers(bool enabled)
+{
+	auto_workers = enabled;
+	tuner.reset();
+	if (enabled)
+		set_worker_count(worker_tuner::initial_count(!headless));
+}
+
+void viewport::update_texture()
+{
+	int width = get_width();
+	int64_t image_pixels = static_cast<int64_t>(width) * get_height();
+
+	// Only the tiles merged since the last upload, unless the whole image changed. Heatmaps are scaled to the whole
+	// image, so they always are
+	bool full = full_upload || display != Display_color;
+	int64_t pixels = 0;
+	if (!full)
+	{
+		std::sort(dirty_rects.begin(), dirty_rects.end(), [](const image_tile& a, const image_tile& b)
+		{
+			return a.y != b.y ? a.y < b.y : a.x < b.x;
+		});
+		dirty_rects.erase(std::unique(dirty_rects.begin(), dirty_rects.end(), [](const image_tile& a, const image_tile& b)
+		{
+			return a.x == b.x && a.y == b.y;
+		}), dirty_rects.end());
+		for (const image_tile& rect : dirty_rects)
+			pixels += rect.pixel_count();
+		full = pixels * 2 > image_pixels; // one call beats hundreds of small ones
+	}
+	if (full)
+	{
+		dirty_rects.assign(1, {0, 0, width, get_height()});
+		pixels = image_pixels;
+	}
+
+	// The tonemap writes straight into a pixel buffer that's copied to the texture in the background
+	auto* out = static_cast<uint8_t*>(upload_ring.map(pixels * 4));
+	if (!out)
+		return; // the GPU is still busy with the last frames, try again next frame
+
+	if (display == Display_color)
+	{
+		// normalization; convert to sdr. One job per row of every rectangle
+		trace_span tonemap_span("viewport::update tonemap");
+		upload_rows.clear();
+		size_t offset = 0;
+		for (const image_tile& rect : dirty_rects)
+		{
+			for (int y = rect.y; y < rect.y + rect.height; y++)
+			{
+				upload_rows.push_back({(static_cast<size_t>(y) * width + rect.x) * channels_per_pixel, offset, rect.width});
+				offset += static_cast<size_t>(rect.width) * 4;
+			}
+		}
+
+		merge_pool.parallel_for(upload_rows.size(), 8, [&](size_t begin, size_t end)
+		{
+			thread_local std::vector<float> scratch;
+			for (size_t r = begin; r < end; r++)
+			{
+				const upload_row& row = upload_rows[r];
+				scratch.resize(static_cast<size_t>(row.pixels) * 3);
+				normalize_to_rgba8(current_tex.data() + row.source, density_map.data() + row.source, out + row.offset,
+				                   row.pixels, scratch.data());
+			}
+		});
+	}
+	else
+	{
+		trace_span tonemap_span("viewport::update heatmap");
+		std::vector<float> heatmap = get_heatmap(display, heatmap_scale);
+		for (int64_t px = 0; px < image_pixels; px++)
+		{
+			for (int c = 0; c < 3; c++)
+				out[px * 4 + c] = static_cast<uint8_t>(std::min(heatmap[px * 3 + c], 1.0f) * 255.0f + 0.5f);
+			out[px * 4 + 3] = 255;
+		}
+	}
+
+	// OpenGL: sub texture
+	trace_span upload_span("viewport::update GL upload");
+	upload_ring.upload(texture_id, dirty_rects, GL_RGBA, GL_UNSIGNED_BYTE, 4);
+	dirty_rects.clear();
+	display_dirty = false;
+	full_upload = false;
+}
+
 void viewport::set_resolution(int resolution_width, int resolution_height)
 {
 	if (resolution_width <= 10 || resolution_height <= 10)
@@ -199,34 +432,78 @@ void viewport::set_resolution(int resolution_width, int resolution_height)
 
 	reset();
 
+	if (headless)
+		return;
+
 	// OpenGL: Change texture (resolution change)
 	glBindTexture(GL_TEXTURE_2D, texture_id);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, resolution_width, resolution_height, 0,
-	             GL_RGB, GL_FLOAT, current_tex.data());
+	// 8-bit, already tonemapped. A quarter of the upload RGB32F needed
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, resolution_width, resolution_height, 0,
+	             GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	full_upload = true;
+	display_dirty = true;
 
 }
 
+/// Fresh allocation without writing it if the size changed, so the pages aren't placed yet
+template <typename T>
+static void allocate_untouched(huge_vector<T>& buffer, size_t size)
+{
+	if (buffer.size() == size)
+		return;
+	buffer = huge_vector<T>(); // a plain resize() would copy the old contents over from this thread
+	buffer.resize(size);
+}
+
 void viewport::reset()
 {
 	// clear backlog
-	std::queue<std::vector<float>> empty;
-	std::swap( backlog, empty );
+	{
+		render_pass* pass;
+		while (backlog.try_pop(pass))
+			pass_pool::release(pass);
+	}
 
 	// update resolution, clear data
 	target_scene.s_camera.ready();
 
-	current_tex = std::vector<float>(get_width() * get_height() * channels_per_pixel);
-	density_map = std::vector<int>(get_width() * get_height() * channels_per_pixel);
-
-	// reset workers
-	for (auto &worker : workers)
+	// The allocation (and its huge pages) is kept when the resolution stays the same. A new one is left unwritten
+	// here and zeroed by the merge threads in row bands, the way they merge: on Linux a page lands on the NUMA node of the
+	// thread that first writes it, so the framebuffers are spread over the merging threads instead of all sitting on
+	// the UI thread's node
+	auto pixels = static_cast<size_t>(get_width()) * get_height();
+	allocate_untouched(current_tex, pixels * channels_per_pixel);
+	allocate_untouched(density_map, pixels * channels_per_pixel);
+	allocate_untouched(cost_tex, pixels * 3);
+	allocate_untouched(cost_density, pixels);
+	auto row = static_cast<size_t>(get_width());
+	merge_pool.parallel_for(get_height(), 16, [&](size_t band_begin, size_t band_end)
 	{
-		worker->reset();
-	}
+		std::fill(current_tex.begin() + band_begin * row * channels_per_pixel,
+		          current_tex.begin() + band_end * row * channels_per_pixel, 0.0f);
+		std::fill(density_map.begin() + band_begin * row * channels_per_pixel,
+		          density_map.begin() + band_end * row * channels_per_pixel, 0);
+		std::fill(cost_tex.begin() + band_begin * row * 3, cost_tex.begin() + band_end * row * 3, 0.0f);
+		std::fill(cost_density.begin() + band_begin * row, cost_density.begin() + band_end * row, 0);
+	});
+	dirty_rects.clear();
+	full_upload = true;
+
+	// New generation, running jobs give up by themselves. The workers stay paused while the scene is being edited,
+	// update() resets again once it's rebuilt
+	// With a target latency the first round is a single sample, so a new image shows up as soon as possible
+	round_samples = target_latency_ms > 0 ? 1 : sample_count;
+	scheduler.set_round_samples(round_samples);
+	if (target_scene.is_dirty())
+		scheduler.pause();
+	else
+		scheduler.reset(get_width(), get_height(), tile_size, sample_limit);
 
+	tuner.restart_interval(); // cancelled work would count against the current worker count
 	index = 0;
 	dirty = false;
 	current_samples = 0;
+	merged_samples = 0;
 }
 
 void viewport::init_new_camera()
@@ -234,11 +511,9 @@ void viewport::init_new_camera()
 	camera& cam = get_camera();
 	cam.max_bounces = max_bounces;
 	cam.bias = bias;
-	cam.sample_count = sample_count;
-	cam.min_samples = min_samples;
-	cam.basic_ratio = basic_ratio;
-	cam.fill_ratio = fill_ratio;
 	cam.dark_samples = dark_samples;
+	cam.seed = seed;
+	cam.set_record_cost(display != Display_color);
 	// cam.ready();
 	mark_dirty();
 }
@@ -1,23 +1,98 @@
 ﻿#ifndef RAYTRACINGWEEKEND_VIEWPORT_H
 #define RAYTRACINGWEEKEND_VIEWPORT_H
 #include <memory>
-#include <queue>
+#include <mutex>
 
+#include "huge_page_allocator.h"
+#include "frame_pool.h"
+#include "mpsc_ring.h"
+#include "pbo_ring.h"
 #include "render_worker.h"
 #include "scene.h"
+#include "task_pool.h"
+#include "tile_scheduler.h"
+#include "worker_tuner.h"
 #include "include/glad/glad.h" // because CLion is fucking stupid
 
+/// What the viewport texture shows. The cost views are false color heatmaps, averaged per sample
+enum display_mode
+{
+	Display_color,
+	Display_time,             // nanoseconds
+	Display_bvh_nodes,        // BVH nodes visited
+	Display_primitive_tests   // sphere/quad intersection tests
+};
 
+[[nodiscard]] inline std::string display_mode_get_human_name(display_mode mode)
+{
+	switch (mode)
+	{
+	case Display_color:
+		return "Color";
+	case Display_time:
+		return "Heatmap: time";
+	case Display_bvh_nodes:
+		return "Heatmap: BVH nodes";
+	case Display_primitive_tests:
+		return "Heatmap: primitive tests";
+	default:
+		return "Unknown";
+	}
+}
+
+[[nodiscard]] inline std::string display_mode_get_unit(display_mode mode)
+{
+	switch (mode)
+	{
+	case Display_time:
+		return "ns";
+	case Display_bvh_nodes:
+		return "nodes";
+	case Display_primitive_tests:
+		return "tests";
+	default:
+		return "";
+	}
+}
+
+/// What gets rendered first, see viewport::set_focus_region()
+enum focus_mode
+{
+	Focus_off,
+	Focus_mouse,      // tiles around the cursor
+	Focus_rectangle,  // a rectangle dragged over the image
+	Focus_selection   // the selected object's bounding box on screen
+};
+
+[[nodiscard]] inline std::string focus_mode_get_human_name(focus_mode mode)
+{
+	switch (mode)
+	{
+	case Focus_off:
+		return "Off";
+	case Focus_mouse:
+		return "Mouse";
+	case Focus_rectangle:
+		return "Rectangle";
+	case Focus_selection:
+		return "Selected object";
+	default:
+		return "Unknown";
+	}
+}
 
 class viewport
 {
 public:
 	scene target_scene;
-	std::vector<int> density_map;  // amount of samples per pixel /// PLEASE DO NOT EDIT OH MY GOD WHY NO LAMBDAS
+	huge_vector<int> density_map;  // amount of samples per pixel /// PLEASE DO NOT EDIT OH MY GOD WHY NO LAMBDAS
+	tile_scheduler scheduler;      // hands out tiles to the workers
+	task_pool build_tasks;         // BVH rebuilds, the workers run them while they're paused for it
 
 	viewport() = delete;
 
-	viewport(scene _scene, int resolution_width, int resolution_height, int workers_count);
+	/// `headless`: No OpenGL texture is created or updated, for running without a window (command line tools)
+	viewport(scene _scene, int resolution_width, int resolution_height, int workers_count, bool headless = false);
 
 	unsigned int get_texture_id() const;
 
@@ -25,6 +100,15 @@ public:
 
 	bool set_worker_count(int count, bool override = false);
 
+	[[nodiscard]] bool get_auto_workers() const
+	{
+		return auto_workers;
+	}
+
+	/// Lets the viewport pick the worker count from the CPUs it may use and the measured samples/s, see worker_tuner.
+	/// Starts from worker_tuner::initial_count(), leaving a core for the UI unless headless
+	void set_auto_workers(bool enabled);
+
 	camera& get_camera()
 	{
 		return target_scene.s_camera;
@@ -48,7 +132,7 @@ public:
 	[[nodiscard]] bool is_waiting() const
 	{
 		if (dirty) return true;
-		if (get_current_sample_count() == 0) return true;
+		if (index == 0) return true; // nothing merged yet
 		return false;
 	}
 
@@ -59,15 +143,46 @@ public:
 
 	bool mark_dirty()
 	{
-		auto was_dirty = dirty;
-		dirty = true;
-		return was_dirty;
+		return dirty.exchange(true);
+	}
+
+	[[nodiscard]] bool has_backlog() const
+	{
+		return !backlog.empty();
+	}
+
+	/// The render_pass slots of worker `worker_index`. They live as long as the viewport, workers come and go
+	pass_pool& get_pass_pool(int worker_index)
+	{
+		return pass_pools[worker_index];
 	}
 
-	int temp_workers_count;
+	/// Stop handing out tiles once every pixel has this many samples. 0 = unlimited
+	void set_sample_limit(int limit)
+	{
+		sample_limit = limit;
+		mark_dirty();
+	}
+
+	/// Returns the accumulated linear (HDR) image, RGB, row by row from the top left
+	[[nodiscard]] std::vector<float> get_image() const;
+
+	/// Returns the cost of `mode` as a false color image (display values, RGB, row by row from the top left).
+	/// `scale` receives the per sample cost that maps to the top of the ramp
+	[[nodiscard]] std::vector<float> get_heatmap(display_mode mode, float& scale) const;
+
+	/// Call before editing the scene. Stops the workers from touching it until the next update() rebuilds it
 	bool mark_scene_dirty();
 
-	void append_image(std::vector<float>& image);
+	/// Like mark_scene_dirty(), for edits that only move, reshape or recolor `object`. The BVH is refit around it
+	/// instead of rebuilt, which takes far less than a frame
+	bool mark_object_changed(const hittable& object);
+
+	/// Queues a finished tile for merging, the slot goes back to its pass_pool after that.
+	/// Tiles from before the last reset are dropped (and count as taken).
+	///
+	/// Returns: False if the backlog is full, keep the slot and try again later
+	bool append_image(render_pass* pass);
 
 	void update();
 
@@ -75,15 +190,55 @@ public:
 
 	void reset();
 
+	/// Cancels all jobs and waits until no worker touches the scene anymore. The threads stay alive
+	void pause_workers();
+
 	void init_new_camera();
 
 private:
+	/// Feeds the tuner, called every update() while auto_workers
+	void tune_worker_count(int64_t new_samples);
+
+	/// Samples per job that make a full size tile take about target_latency_ms
+	void size_jobs_for_latency();
+
+	/// Tonemaps what changed since the last upload into the texture
+	void update_texture();
+
 	int current_samples = 0;
+	int64_t merged_samples = 0; // sum of samples over all pixels
+	int sample_limit = 0;
 	int index = 0;
-	bool dirty = false; // Viewport resolution changed
+	std::atomic<bool> dirty{false}; // Viewport resolution changed. Read by the workers
+	bool headless = false;
 	int channels_per_pixel = 3;
-	std::queue<std::vector<float>> backlog;
-	std::vector<float> current_tex; // color data
+	mpsc_ring<render_pass*, 1024> backlog; // workers append from their own threads, update() takes them
+	std::vector<pass_pool> pass_pools; // one per worker index
+	huge_vector<float> current_tex; // color data
+	huge_vector<float> cost_tex;    // summed per sample cost, same layout as render_pass::cost
+	huge_vector<int> cost_density;  // passes that contributed to cost_tex, per pixel
+	pbo_ring upload_ring;           // texture uploads
+	frame_pool merge_pool;          // merging and tonemapping
+	std::vector<render_pass*> merging; // taken from the backlog this frame
+	float heatmap_scale = 0;
+	bool display_dirty = false;     // texture needs a refresh even without new samples
+	bool full_upload = true;        // the whole texture needs a refresh, not just dirty_rects
+	std::vector<image_tile> dirty_rects; // tiles merged since the last upload
+
+	/// One row of a dirty rectangle: where it is in current_tex and in the upload buffer
+	struct upload_row
+	{
+		size_t source;
+		size_t offset;
+		int pixels;
+	};
+	std::vector<upload_row> upload_rows;
+	bool auto_workers = false;
+	worker_tuner tuner;
+	int target_latency_ms = 0;
+	double sample_cost_ns = 0;      // moving average, see get_sample_cost()
+	int round_samples = 1;
+	static constexpr int max_round_samples = 1024;
 
 	std::vector<std::unique_ptr<render_worker>> workers;
 
@@ -95,10 +250,14 @@ private:
 	int max_bounces;
 	double bias;
 	int sample_count;
-	int min_samples;
-	double basic_ratio;
-	double fill_ratio;
+	int tile_size;
+	uint64_t seed = 0;
 	int dark_samples; // how much the worker prefer dark pixels lol
+	display_mode display = Display_color;
+	focus_mode focus = Focus_off;
+	image_tile focus_region;        // empty = no focus
+	int focus_samples = 256;
+	std::atomic<bool> pin_workers{false}; // workers pick it up themselves, see render_worker::render_loop()
 
 public:
 	[[nodiscard]] int get_max_bounces() const
@@ -132,52 +291,61 @@ public:
 		return sample_count;
 	}
 
+	/// Samples per pixel of each tile job. Ignored while a target latency is set
 	void set_sample_count(int sample_count)
 	{
 		if (sample_count < 1) sample_count = 1;
 		this->sample_count = sample_count;
-		get_camera().sample_count = sample_count;
 		mark_dirty();
 	}
 
-	[[nodiscard]] int get_min_samples() const
+	[[nodiscard]] int get_target_latency() const
 	{
-		return min_samples;
+		return target_latency_ms;
 	}
 
-	void set_min_samples(int min_samples)
+	/// Sizes tile jobs to take about `ms` each (0 = off, use the fixed sample count), from the measured cost of a
+	/// sample. The image then updates at a steady pace no matter the scene or resolution. Doesn't restart the render
+	void set_target_latency(int ms)
 	{
-		if (min_samples < 0) min_samples = 0;
-		this->min_samples = min_samples;
-		get_camera().min_samples = min_samples;
-		mark_dirty();
+		target_latency_ms = std::clamp(ms, 0, 10000);
+		if (target_latency_ms == 0)
+			scheduler.set_round_samples(sample_count);
+	}
+
+	/// Samples per pixel the scheduler currently hands out
+	[[nodiscard]] int get_round_samples() const
+	{
+		return round_samples;
 	}
 
-	[[nodiscard]] double get_basic_ratio() const
+	/// Average time one worker takes for one sample of one pixel (ns), 0 until something was rendered
+	[[nodiscard]] double get_sample_cost() const
 	{
-		return basic_ratio;
+		return sample_cost_ns;
 	}
 
-	void set_basic_ratio(double basic_ratio)
+	[[nodiscard]] uint64_t get_seed() const
 	{
-		if (basic_ratio <= 0) basic_ratio = 0.001;
-		if (basic_ratio > 1) basic_ratio = 1;
-		this->basic_ratio = basic_ratio;
-		get_camera().basic_ratio = basic_ratio;
+		return seed;
+	}
+
+	void set_seed(uint64_t seed)
+	{
+		this->seed = seed;
+		get_camera().seed = seed;
 		mark_dirty();
 	}
 
-	[[nodiscard]] double get_fill_ratio() const
+	[[nodiscard]] int get_tile_size() const
 	{
-		return fill_ratio;
+		return tile_size;
 	}
 
-	void set_fill_ratio(double fill_ratio)
+	void set_tile_size(int tile_size)
 	{
-		if (fill_ratio <= 0) fill_ratio = 0.001;
-		if (fill_ratio > 1) fill_ratio = 1;
-		this->fill_ratio = fill_ratio;
-		get_camera().fill_ratio = fill_ratio;
+		tile_size = std::clamp(tile_size, 4, 512);
+		this->tile_size = tile_size;
 		mark_dirty();
 	}
 
@@ -193,6 +361,90 @@ public:
 		get_camera().dark_samples = _dark_samples;
 		mark_dirty();
 	}
+
+	[[nodiscard]] bvh_build get_bvh_build() const
+	{
+		return target_scene.get_bvh_build();
+	}
+
+	void set_bvh_build(bvh_build method)
+	{
+		if (method == target_scene.get_bvh_build())
+			return;
+		mark_scene_dirty(); // workers stop before the tree they're walking is replaced
+		target_scene.set_bvh_build(method);
+	}
+
+	[[nodiscard]] display_mode get_display_mode() const
+	{
+		return display;
+	}
+
+	/// Doesn't restart the render. Cost is only recorded while a heatmap is shown, so a heatmap fills in from then on
+	void set_display_mode(display_mode mode)
+	{
+		display = mode;
+		get_camera().set_record_cost(mode != Display_color);
+		display_dirty = true;
+		full_upload = true;
+	}
+
+	[[nodiscard]] focus_mode get_focus_mode() const
+	{
+		return focus;
+	}
+
+	/// The UI turns the mode into a region every frame. Turning it off clears the region
+	void set_focus_mode(focus_mode mode)
+	{
+		focus = mode;
+		if (mode == Focus_off)
+			set_focus_region({});
+	}
+
+	[[nodiscard]] const image_tile& get_focus_region() const
+	{
+		return focus_region;
+	}
+
+	/// Tiles touching `region` (pixels) get all the samples until they have get_focus_samples(), then the rest of the
+	/// image fills in. An empty region renders everything evenly. Doesn't restart the render
+	void set_focus_region(const image_tile& region)
+	{
+		if (region.x == focus_region.x && region.y == focus_region.y &&
+			region.width == focus_region.width && region.height == focus_region.height)
+			return;
+		focus_region = region;
+		scheduler.set_focus(focus_region, focus_samples);
+	}
+
+	[[nodiscard]] int get_focus_samples() const
+	{
+		return focus_samples;
+	}
+
+	void set_focus_samples(int samples)
+	{
+		focus_samples = std::clamp(samples, 1, 1 << 20);
+		scheduler.set_focus(focus_region, focus_samples);
+	}
+
+	[[nodiscard]] bool get_pin_workers() const
+	{
+		return pin_workers.load(std::memory_order_relaxed);
+	}
+
+	/// Pins worker i to the i-th allowed CPU (wrapping around), or lets them float again. Doesn't restart the render
+	void set_pin_workers(bool pin)
+	{
+		pin_workers.store(pin, std::memory_order_relaxed);
+	}
+
+	/// Per sample cost at the top of the heatmap ramp, as of the last texture update
+	[[nodiscard]] float get_heatmap_scale() const
+	{
+		return heatmap_scale;
+	}
 };
 
 #endif //RAYTRACINGWEEKEND_VIEWPORT_H
\ No newline at end of file
@@ -16,6 +16,7 @@
 
 #include "scene.h"
 #include "scene_presets.h"
+#include "trace.h"
 #include "transformers.h"
 #include "viewport.h"
 #include "volume_convex.h"
@@ -133,11 +134,14 @@ int main(int argc, char* argv[])
 	user_interface ui;
 
 	// Init viewport
-	// TODO: do proper thingy
-	viewport vp(preset_scene_creator::create_scene(Cornell), 300, 300, 8);
+	viewport vp(preset_scene_creator::create_scene(Cornell), 300, 300, worker_tuner::initial_count(true));
+	vp.set_auto_workers(true);
+
+	trace::set_thread_name("ui");
 
 	while (!glfwWindowShouldClose(window))
 	{
+		trace_span frame_span("frame");
 		glfwPollEvents();
 
 		// imgui
@@ -0,0 +1,80 @@
+﻿#include "worker_tuner.h"
+
+#include <algorithm>
+
+#include "thread_affinity.h"
+
+int worker_tuner::initial_count(bool leave_ui_core)
+{
+	return max_count(leave_ui_core);
+}
+
+int worker_tuner::max_count(bool leave_ui_core)
+{
+	int cpus = thread_affinity::usable_cpu_count();
+	return std::max(1, leave_ui_core ? cpus - 1 : cpus);
+}
+
+void worker_tuner::reset()
+{
+	*this = worker_tuner();
+}
+
+void worker_tuner::restart_interval()
+{
+	interval_start = -1;
+	interval_samples = 0;
+}
+
+int worker_tuner::update(int64_t samples, double now, int count, int max)
+{
+	if (interval_start < 0)
+	{
+		interval_start = now;
+		interval_samples = 0;
+		return count;
+	}
+
+	interval_samples += samples;
+	if (now - interval_start < interval)
+		return count;
+
+	double rate = static_cast<double>(interval_samples) / (now - interval_start);
+	restart_interval();
+	interval_start = now;
+
+	if (probing)
+	{
+		probing = false;
+		// Going up has to beat the noise. Going down has to be at least as fast: fewer threads for the same speed
+		// leaves the machine more responsive, but allowing any loss would let noisy intervals ratchet the count down
+		bool kept = direction > 0 ? rate > base_rate * (1 + min_gain) : rate >= base_rate;
+		if (!kept)
+		{
+			direction = -direction;
+			settle = settle_intervals;
+			return probe_from; // base_rate is still the rate there
+		}
+		settle = 0; // worked, keep going
+	}
+
+	base_rate = rate;
+	if (settle > 0)
+	{
+		settle--;
+		return count;
+	}
+
+	int step = std::max(1, count / 8);
+	int next = std::clamp(count + direction * step, 1, max);
+	if (next == count)
+	{
+		direction = -direction; // at a bound, try the other way next time
+		settle = settle_intervals;
+		return count;
+	}
+
+	probing = true;
+	probe_from = count;
+	return next;
+}
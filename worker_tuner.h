@@ -0,0 +1,47 @@
+﻿#ifndef RAYTRACINGWEEKEND_WORKER_TUNER_H
+#define RAYTRACINGWEEKEND_WORKER_TUNER_H
+
+#include <cstdint>
+
+/// Picks the number of render workers by hill climbing on measured throughput.
+///
+/// Every `interval` seconds the samples rendered in that time are compared with the last measurement. A probe moves
+/// the worker count by one step and keeps the move if throughput went up (or, when going down, didn't drop at all).
+/// Otherwise it goes back and tries the other direction after `settle_intervals`.
+class worker_tuner
+{
+public:
+	static constexpr double interval = 1.0;      // seconds per measurement
+	static constexpr double min_gain = 0.03;     // relative change smaller than this is noise
+	static constexpr int settle_intervals = 5;   // measurements between probes once a probe didn't pay off
+
+	/// Workers to start with: every usable CPU (affinity mask and cgroup quota), one left for the UI thread if asked
+	[[nodiscard]] static int initial_count(bool leave_ui_core);
+
+	/// Most workers the tuner will go to, the same bound as initial_count()
+	[[nodiscard]] static int max_count(bool leave_ui_core);
+
+	/// Forgets all measurements, e.g. after the count was changed by hand
+	void reset();
+
+	/// Drops the measurement in progress, call when the render restarts and the samples so far don't count
+	void restart_interval();
+
+	/// Feeds samples (pixel samples) finished since the last call. `now`: seconds, any steady clock. `max`: most
+	/// workers to go to, see max_count()
+	///
+	/// Returns: The worker count to use from now on
+	int update(int64_t samples, double now, int count, int max);
+
+private:
+	double interval_start = -1;
+	int64_t interval_samples = 0;
+
+	double base_rate = 0;   // samples/s at the count we'd go back to
+	bool probing = false;
+	int probe_from = 0;     // count before the probe
+	int direction = -1;     // start by trying fewer, the initial count is already the most we'd usually want
+	int settle = 0;         // measurements left before the next probe
+};
+
+#endif //RAYTRACINGWEEKEND_WORKER_TUNER_H